@@ -4,7 +4,7 @@
  * Supports: Windows (Progman/WorkerW) and Linux X11 (root window pixmap)
  * 
  * Build on Windows: cl /O2 main.cpp /link OpenGL32.lib winmm.lib
- * Build on Linux:   g++ -O2 main.cpp -o live-dither-wp -lX11 -lXrandr -lXext
+ * Build on Linux:   g++ -O2 -pthread main.cpp -o live-dither-wp -lX11 -lXrandr -lXext
  * 
  * CLI: ./live-dither-wp [image] [algorithm] [threshold] [pixel_size] [max_fps] [profile] [chaos]
  *   image: path to background image (default: bg.jpg)
@@ -14,6 +14,33 @@
  *   max_fps: FPS limit (0 = unlimited, default 60)
  *   profile: 0=off, 1=on (print timing info)
  *   chaos: 0-100 randomness blend for wave
+ *
+ * Options (--key=value, may appear anywhere):
+ *   --backend: X11 upload path, zpixmap, bitmap, overlay or rects (default: overlay)
+ *   --double-buffer: 0=draw straight to the window, 1=back buffer + present (default 1)
+ *   --max-inflight: frames queued at the X server before dithering pauses (default 2)
+ *   --root-pixmap: publish frames as _XROOTPMAP_ID, refreshed N times per second (default 0 = off)
+ *   --xcb: 0=Xlib only, 1=XCB startup queries and frame uploads when built in (default 1)
+ *   --occlusion: 0=always render everything, 1=skip tiles covered by other windows (default 1)
+ *   --idle-timeout: seconds without input before dropping to --idle-fps (default 300, 0 = off)
+ *   --idle-fps: FPS limit while the user is idle (default 5); blanked screens render nothing
+ *   --fullscreen-pause: 1=pause while the focused window is fullscreen (default 1)
+ *   --focus-classes: comma-separated WM_CLASS names that cap the FPS while focused
+ *   --focus-fps: FPS limit while one of --focus-classes is focused (default 10)
+ *   --monitor: NAME:image=PATH,pixel=N,fps=N per-monitor overrides, repeatable
+ *   --bands: horizontal bands a frame still being dithered is uploaded in (default 4, 1 = whole frames)
+ *   --spin-us: microseconds to busy-wait before each frame deadline (default 0)
+ *   --power-policy: 1=switch profiles with battery and thermal state (default 1)
+ *   --power-profile: STATE:fps=N,pixel=N,algorithm=N,flip=N,slack=US for ac, battery, low or hot;
+ *     profiles change nothing until set here, and without any the power state isn't polled
+ *   --sysfs-root: where power_supply and thermal are read from (default /sys)
+ *   --low-battery: battery percent below which the low profile applies (default 20)
+ *   --hot-temp: degrees C at which the hot profile applies (default 85)
+ *   --cpu-budget: percent of one core to hold CPU use under by lowering quality (default 0 = off)
+ *   --background: 1=dither at idle priority and coalesce timer wakeups (default 0)
+ *   --nice: nice level for the dithering threads in background mode instead of SCHED_IDLE (default 0)
+ *   --cores: auto, efficient, all or a CPU list like 0-3,8 to pin every thread to (default auto)
+ *   --lookahead: frames dithered ahead of the one on screen (default 4, 0 = just the next)
  */
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -26,6 +53,14 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 /*
  * Platform Detection
@@ -56,14 +91,55 @@
 #endif
 
 #if PLATFORM_X11
+    #ifndef HAVE_XPRESENT
+        #define HAVE_XPRESENT 0
+    #endif
+    #ifndef HAVE_XCB
+        #define HAVE_XCB 0
+    #endif
+    #ifndef HAVE_XCB_SHM
+        #define HAVE_XCB_SHM 0
+    #endif
+    #ifndef HAVE_XSS
+        #define HAVE_XSS 0
+    #endif
     #include <X11/Xlib.h>
     #include <X11/Xatom.h>
     #include <X11/keysym.h>
     #include <X11/extensions/Xrandr.h>
     #include <X11/extensions/shape.h>
-    #include <sys/time.h>
+    #include <X11/extensions/sync.h>
+    #include <X11/extensions/dpms.h>
+    #if HAVE_XSS
+        #include <X11/extensions/scrnsaver.h>
+    #endif
+    #if HAVE_XPRESENT
+        #include <X11/extensions/Xpresent.h>
+    #endif
+    #if HAVE_XCB
+        #include <X11/Xlib-xcb.h>
+        #include <xcb/xcb.h>
+    #endif
+    #if HAVE_XCB_SHM
+        #include <xcb/shm.h>
+        #include <sys/ipc.h>
+        #include <sys/shm.h>
+    #endif
+    #include <time.h>
+    #include <errno.h>
+    #include <strings.h>
+    #include <dirent.h>
+    #include <sys/prctl.h>
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <sched.h>
+    #include <pthread.h>
     #include <unistd.h>
     #include <signal.h>
+    #include <poll.h>
+    #include <sys/epoll.h>
+    #include <sys/timerfd.h>
+    #include <sys/inotify.h>
 #endif
 
 /*
@@ -76,7 +152,30 @@ int g_pixelSize = 1;      // pixel block size
 int g_maxFps = 60;        // Max FPS (0 = unlimited)
 int g_profile = 1;        // Profiling output
 int g_chaos = 10;         // Chaos/randomness blend (0-100)
-float g_time = 0.0f;      // Animation time for wave algorithm
+int g_backend = 2;        // X11 upload: 0=zpixmap, 1=bitmap, 2=overlay, 3=rects
+int g_doubleBuffer = 1;   // X11: draw into a server back buffer, then present
+int g_maxInFlight = 2;    // X11: frames the server may lag behind before dithering pauses
+float g_rootPixmapRate = 0.0f;  // X11: root pixmap refreshes per second (0 = off)
+int g_useXcb = 1;         // X11: XCB startup queries and uploads, when built in
+int g_occlusion = 1;      // X11: skip tiles covered by other windows
+int g_idleTimeout = 300;  // Seconds without input before throttling (0 = off)
+int g_idleFps = 5;        // FPS limit while idle
+int g_fullscreenPause = 1;        // X11: pause while the focused window is fullscreen
+const char* g_focusClasses = "";  // X11: WM_CLASS names that cap the FPS while focused
+int g_focusFps = 10;              // FPS limit while one of them is focused
+int g_bands = 4;          // Bands a frame still being dithered is uploaded in (1 = whole frames)
+int g_spinUs = 0;         // Busy-wait this long before a frame deadline instead of sleeping
+int g_lookahead = 4;      // Frames dithered ahead while the presenter waits for its deadline
+int g_powerPolicy = 1;    // Switch power profiles with battery and thermal state
+const char* g_sysfsRoot = "/sys";  // X11: root of the power_supply and thermal classes
+int g_lowBattery = 20;    // Battery percent at which the low profile takes over
+int g_hotTemp = 85;       // Degrees C at which the hot profile takes over
+int g_flipPercent = 100;  // Tile rows re-dithered each frame, in percent (set by the power profile)
+float g_cpuBudget = 0.0f; // Percent of one core the CPU governor holds to (0 = off)
+int g_background = 0;     // Dithering threads at idle priority, large timer slack
+int g_niceLevel = 0;      // Background mode: nice level instead of SCHED_IDLE (0 = SCHED_IDLE)
+int g_cpuLimit = 1;       // CPUs the process may use, from the affinity mask and cgroup quota
+const char* g_cores = "auto";  // CPUs to pin to: auto (verified hybrids only), efficient, all, or a list
 bool g_running = true;    // Main loop control
 
 
@@ -99,8 +198,50 @@ enum PixelState : uint8_t {
 
 std::vector<PixelState> g_pixelStates;
 std::vector<float> g_orangeProb;
-std::vector<int> g_ambiguousIndices;
-std::vector<uint8_t> g_scaledPixels;  // RGBA output buffer
+std::vector<int> g_ambiguousIndices;  // grouped by tile, row-major inside a tile
+std::vector<uint8_t> g_frameBuffers[3];  // RGBA frames, triple buffered between dither and upload
+uint8_t* g_scaledPixels = nullptr;    // the frame being presented (one of g_frameBuffers)
+
+
+// Tile grid over the dither resolution; covered tiles are skipped entirely
+const int TILE_SIZE = 32;             // tile edge in dither pixels
+int g_tilesX = 0;
+int g_tilesY = 0;
+std::vector<int> g_tileStart;         // tile t owns g_ambiguousIndices[start[t], start[t+1])
+std::vector<uint8_t> g_tileVisible;   // 0 = fully covered by other windows or off every monitor
+
+
+// Per-monitor state: each monitor dithers its own image at its own block size and rate
+// into the shared grid. Pixels between monitors of different sizes belong to none.
+struct MonitorConfig {
+    std::string name;                 // XRandR output name, e.g. HDMI-1
+    std::string image;                // empty = image argument
+    int pixelSize = 0;                // 0 = pixel_size argument
+    int fps = 0;                      // 0 = every frame
+};
+std::vector<MonitorConfig> g_monitorConfigs;  // from --monitor
+
+struct TileSpan {
+    int tile;
+    int begin, end;                   // range of g_ambiguousIndices
+};
+
+struct Monitor {
+    std::string name;
+    int x = 0, y = 0, width = 0, height = 0;  // screen pixels
+    std::string image;
+    int block = 1;                    // dither cell edge in grid pixels
+    int fps = 0;
+    int gx0 = 0, gy0 = 0, gx1 = 0, gy1 = 0;   // grid rectangle
+    int cellsX = 0, cellsY = 0;
+    std::vector<TileSpan> spans;      // this monitor's ambiguous pixels, by tile
+    std::vector<float> rowSine;       // wave phase per cell row, refreshed each frame
+    float time = 0.0f;                // animation time for the wave algorithm
+    uint32_t seed = 0;                // per-frame random seed
+    double nextFrame = 0.0;
+    bool due = false;
+};
+std::vector<Monitor> g_monitors;
 
 
 const uint8_t BLACK_RGBA[4] = {0, 0, 0, 255};
@@ -117,70 +258,338 @@ const uint8_t ORANGE_RGBA[4] = {255, 140, 0, 255};
     HDC g_hDC = nullptr;
     HGLRC g_hRC = nullptr;
     GLuint g_textureID = 0;
+    int g_textureWidth = 0;           // texture storage size, reallocated when the frame size changes
+    int g_textureHeight = 0;
 #endif
 
 #if PLATFORM_X11
     Display* g_display = nullptr;
+    
+    // Every atom we use, interned together in one round trip
+    enum AtomId {
+        ATOM_NET_WM_WINDOW_TYPE,
+        ATOM_NET_WM_WINDOW_TYPE_DESKTOP,
+        ATOM_NET_WM_STATE,
+        ATOM_NET_WM_STATE_BELOW,
+        ATOM_NET_WM_STATE_SKIP_TASKBAR,
+        ATOM_NET_WM_STATE_SKIP_PAGER,
+        ATOM_NET_WM_STATE_STICKY,
+        ATOM_XFCE_DESKTOP_WINDOW,
+        ATOM_LIVE_DITHER_FRAME,
+        ATOM_XROOTPMAP_ID,
+        ATOM_ESETROOT_PMAP_ID,
+        ATOM_NET_CLIENT_LIST_STACKING,
+        ATOM_NET_ACTIVE_WINDOW,
+        ATOM_NET_WM_STATE_FULLSCREEN,
+        ATOM_COUNT
+    };
+    const char* ATOM_NAMES[ATOM_COUNT] = {
+        "_NET_WM_WINDOW_TYPE",
+        "_NET_WM_WINDOW_TYPE_DESKTOP",
+        "_NET_WM_STATE",
+        "_NET_WM_STATE_BELOW",
+        "_NET_WM_STATE_SKIP_TASKBAR",
+        "_NET_WM_STATE_SKIP_PAGER",
+        "_NET_WM_STATE_STICKY",
+        "XFCE_DESKTOP_WINDOW",
+        "_LIVE_DITHER_FRAME",
+        "_XROOTPMAP_ID",
+        "ESETROOT_PMAP_ID",
+        "_NET_CLIENT_LIST_STACKING",
+        "_NET_ACTIVE_WINDOW",
+        "_NET_WM_STATE_FULLSCREEN"
+    };
+    Atom g_atoms[ATOM_COUNT];
+    
+#if HAVE_XCB
+    // XCB on the Xlib connection: pipelined startup queries and direct frame upload
+    xcb_connection_t* g_xcb = nullptr;
+    size_t g_xcbMaxRequest = 0;           // bytes
+    bool g_xcbBitmapOk = false;           // server takes our LSBFirst bitmaps as is
+    bool g_xcbZPixmapOk = false;          // server takes our ZPixmap rows as is
+    xcb_query_tree_cookie_t g_rootTreeCookie;
+#endif
+#if HAVE_XCB_SHM
+    struct ShmBuffer { xcb_shm_seg_t seg; int id; char* addr; };
+    ShmBuffer g_bitmapShm = {0, -1, nullptr};
+    ShmBuffer g_imageShm = {0, -1, nullptr};
+    bool g_shmAvailable = false;
+#endif
     Window g_root;
     Window g_window;  // Our desktop window
     GC g_gc;
     XImage* g_ximage = nullptr;
     char* g_imageData = nullptr;
+    size_t g_imageCapacity = 0;
+    XImage* g_bitmapImage = nullptr;  // 1-bpp frame, drawn with GC fg/bg
+    char* g_bitmapData = nullptr;
+    size_t g_bitmapCapacity = 0;
+    unsigned long g_blackPixel = 0;
+    unsigned long g_orangePixel = 0;
+    
+    // Overlay backend: static layer lives on the server, only ambiguous tiles are sent
+    Pixmap g_staticPixmap = None;
+    Pixmap g_ambiguousMask = None;        // depth 1, set where pixels animate
+    Pixmap g_stipple = None;              // depth 1, set where ambiguous pixels are orange
+    GC g_maskGC = nullptr;
+    GC g_overlayGC = nullptr;
+    std::vector<XRectangle> g_overlayRects;   // visible tiles with ambiguous pixels, as runs
+    std::vector<XRectangle> g_visibleRects;   // all visible tiles, as runs
+    
+    // Rectangle path: changed blocks are filled directly, no image data at all
+    std::vector<uint8_t> g_presented;     // on-screen color of each ambiguous pixel
+    bool g_presentedValid = false;        // false until a full overlay upload lands
+    bool g_frameUsedRects = false;
+    std::vector<XRectangle> g_orangeRuns;
+    std::vector<XRectangle> g_blackRuns;
+    int g_rectFrames = 0;
+    
+    // Double buffering: frames are drawn into g_backBuffer and shown with one copy
+    struct DamageBox { int x0, y0, x1, y1; };
+    Pixmap g_backBuffer = None;
+    Drawable g_target = None;             // g_backBuffer, or g_window without double buffering
+    DamageBox g_damage = {INT_MAX, INT_MAX, 0, 0};
+    bool g_presentPending = false;        // waiting for PresentCompleteNotify
+#if HAVE_XPRESENT
+    bool g_presentAvailable = false;
+    int g_presentOpcode = 0;
+    uint32_t g_presentSerial = 0;
+    XserverRegion g_presentRegion = None;
+    XID g_presentEventId = None;
+    uint64_t g_lastMsc = 0;               // vblank counter of the last completed present
+    int g_lateFrames = 0;
+#endif
+    
+    // Backpressure: a property change per frame comes back as PropertyNotify once
+    // the server has worked through everything before it
+    int g_framesInFlight = 0;
+    int g_peakInFlight = 0;
+    int g_throttledFrames = 0;            // frames that filled the queue
+    
+    // Root pixmap mode: a copy of the frame advertised as _XROOTPMAP_ID for
+    // pseudo-transparent terminals and panels, refreshed at a lower rate
+    Pixmap g_rootPixmap = None;
+    Pixmap g_savedRootPmaps[2] = {None, None};
+    DamageBox g_rootDamage = {INT_MAX, INT_MAX, 0, 0};
+    double g_lastRootRefresh = 0.0;
+    
+    // Occlusion: other clients' geometry decides which tiles can be seen at all
+    // Root geometry of one stacked client, kept current from its structure events
+    struct ClientWindow {
+        Window id;
+        XRectangle rect;
+        bool queried;       // depth, map state and size read once from the server
+        bool positioned;    // rect.x/y are root coordinates, not stale
+        bool viewable;
+        bool opaque;        // ARGB windows may be translucent and hide nothing
+    };
+    std::vector<ClientWindow> g_clients;  // _NET_CLIENT_LIST_STACKING
+    Window g_xfdesktopWin = None;
+    bool g_occlusionDirty = false;
+    const double OCCLUSION_INTERVAL = 0.05;   // seconds between occlusion updates
+    double g_lastOcclusionUpdate = 0.0;
+    long long g_visibleArea = 0;          // screen pixels in visible tiles
+    XErrorHandler g_defaultErrorHandler = nullptr;
+    std::vector<Window> g_goneWindows;    // no longer tracked; errors about them may still arrive
+    const size_t GONE_WINDOWS = 64;
+    
+    // Nothing is dithered while our window can't be seen at all
+    bool g_windowMapped = true;
+    bool g_windowObscured = false;        // VisibilityFullyObscured
+    
+    // Idle throttling: IDLETIME alarms flip g_userIdle, blanked screens pause entirely
+    int g_syncEventBase = 0;
+    XSyncAlarm g_idleAlarm = None;        // fires when idle time crosses the timeout
+    XSyncAlarm g_activeAlarm = None;      // fires when input resets idle time
+    bool g_userIdle = false;
+    bool g_saverActive = false;           // MIT-SCREEN-SAVER says the saver is on
+    bool g_displayOff = false;            // DPMS standby/suspend/off
+    bool g_dpmsAvailable = false;
+    double g_lastIdlePoll = 0.0;
+    int g_saverEventBase = -1;
+    
+    // Focus policy: the active window's state and class decide the frame rate
+    bool g_focusTracking = false;
+    Window g_activeWindow = None;
+    bool g_activeFullscreen = false;
+    bool g_activeMatched = false;         // WM_CLASS is one of --focus-classes
+    
+    // Resolution changes and hotplug arrive in bursts; relayout once they settle
+    int g_randrEventBase = -1;
+    bool g_layoutDirty = false;
+    double g_layoutChangeTime = 0.0;
+    const double SETTLE_DELAY = 0.5;          // seconds of quiet before a layout or image change applies
+    
+    // Event loop: one epoll set for the X connection, the frame timer and image file changes
+    int g_epollFd = -1;
+    int g_timerFd = -1;
+    int g_inotifyFd = -1;
+    struct ImageWatch { int wd; std::string name; };
+    std::vector<ImageWatch> g_imageWatches;   // watched directory and file name of each image
+    bool g_imagesDirty = false;
+    double g_imageChangeTime = 0.0;
+    
+    double g_refreshRate = 0.0;           // Hz of the primary CRTC, 0 if unknown
+    int g_vblankDivisor = 0;              // present on every Nth vblank
+    int g_maxFpsDivisor = 0;              // the divisor max_fps snapped to
     int g_screen;
 #endif
 
 /*
- * Fast Random Number Generator (Xorshift)
+ * Fast Random Numbers
  */
-static uint32_t g_rngState = 12345;
+// Stateless hash of a dither cell and the frame seed. Every grid pixel of a cell gets the
+// same value, which keeps blocks solid, and workers share no generator state.
+inline float cellRandFloat(uint32_t cell, uint32_t seed) {
+    uint32_t h = cell * 0x9E3779B1u ^ seed;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return (float)(h & 0xFFFF) / 65535.0f;
+}
+
+double platformGetTime();
+void platformSleepUntil(double deadline);
+int platformPowerState(int current);
+void platformSetTimerSlack(int us);
+double platformThreadCpuTime();
+int platformCpuLimit();
+void platformLowerThreadPriority();
+int platformCoreClasses(std::vector<int>& classOf, bool byFrequency);
+bool platformPinThreads(const std::vector<int>& cpus);
+int platformCurrentCpu();
+void platformRenderBand(int row0, int row1);
+void platformPresent();
+void platformSkipFrame();
+void platformTilesChanged();
+bool platformPaceFps(int fps);
+void seedLookahead();
 
-inline uint32_t fastRand() {
-    g_rngState ^= g_rngState << 13;
-    g_rngState ^= g_rngState >> 17;
-    g_rngState ^= g_rngState << 5;
-    return g_rngState;
+/*
+ * Monitor Layout
+ */
+// Fill in image, block size and rate for each monitor from --monitor and the arguments.
+// With no monitor information, the whole screen is one monitor.
+void configureMonitors(std::vector<Monitor>& monitors, int screenWidth, int screenHeight, int gridSize) {
+    if (monitors.empty()) {
+        Monitor screen;
+        screen.name = "screen";
+        screen.width = screenWidth;
+        screen.height = screenHeight;
+        monitors.push_back(screen);
+    }
+    
+    for (size_t i = 0; i < monitors.size(); i++) {
+        Monitor& m = monitors[i];
+        m.image = g_imagePath;
+        int pixelSize = gridSize;
+        for (const MonitorConfig& config : g_monitorConfigs) {
+            if (config.name != m.name) continue;
+            if (!config.image.empty()) m.image = config.image;
+            if (config.pixelSize > 0) pixelSize = config.pixelSize;
+            m.fps = config.fps;
+        }
+        // Blocks are whole grid pixels, so pixel sizes round to multiples of the grid's
+        m.block = (pixelSize + gridSize / 2) / gridSize;
+        if (m.block < 1) m.block = 1;
+        m.seed = 0x2545F491u * (uint32_t)(i + 1);
+        
+        std::cout << "Monitor " << m.name << ": " << m.width << "x" << m.height << "+" << m.x << "+" << m.y
+                  << ", image " << m.image << ", pixel size " << m.block * gridSize
+                  << ", " << (m.fps > 0 ? std::to_string(m.fps) + " FPS" : std::string("every frame")) << std::endl;
+    }
+    for (const MonitorConfig& config : g_monitorConfigs) {
+        bool found = false;
+        for (const Monitor& m : monitors) found = found || m.name == config.name;
+        if (!found) std::cerr << "No monitor named " << config.name << std::endl;
+    }
 }
 
-inline float fastRandFloat() {
-    return (float)(fastRand() & 0xFFFF) / 65535.0f;
+// Same rectangles as the layout on screen; a relayout would change nothing
+bool sameMonitorLayout(const std::vector<Monitor>& monitors, int screenWidth, int screenHeight) {
+    if (screenWidth != g_imgWidth || screenHeight != g_imgHeight || monitors.size() != g_monitors.size()) return false;
+    for (size_t i = 0; i < monitors.size(); i++) {
+        const Monitor& a = monitors[i];
+        const Monitor& b = g_monitors[i];
+        if (a.name != b.name || a.x != b.x || a.y != b.y || a.width != b.width || a.height != b.height) return false;
+    }
+    return true;
 }
 
 /*
  * Image Loading and Preparation
  */
-void loadAndPrepareImage(const char* filename, int screenWidth, int screenHeight) {
-    int origWidth, origHeight, channels;
-    unsigned char* data = stbi_load(filename, &origWidth, &origHeight, &channels, 3);
+// Decoded images stay around so monitors sharing a file, and every later relayout,
+// decode it once
+struct SourceImage {
+    std::string path;
+    unsigned char* data;
+    int width, height;
+};
+std::vector<SourceImage> g_sources;
+
+static const SourceImage* loadSource(const std::string& path) {
+    for (const SourceImage& source : g_sources) {
+        if (source.path == path) return &source;
+    }
     
+    int width, height, channels;
+    unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 3);
     if (!data) {
-        std::cerr << "Failed to load image: " << filename << std::endl;
+        std::cerr << "Failed to load image: " << path << std::endl;
+        return nullptr;
+    }
+    std::cout << "Loaded image: " << path << " (" << width << "x" << height << ")" << std::endl;
+    g_sources.push_back({path, data, width, height});
+    return &g_sources.back();
+}
+
+void freeSources() {
+    for (SourceImage& source : g_sources) stbi_image_free(source.data);
+    g_sources.clear();
+}
+
+// Everything prepareImage() derives from the screen geometry. It is built off to the
+// side and swapped into the globals, so a relayout never disturbs the running frame.
+struct PreparedImage {
+    int pixelSize = 1;                // grid pixel size the layout is built for
+    int imgWidth = 0, imgHeight = 0;
+    int scaledWidth = 0, scaledHeight = 0;
+    std::vector<PixelState> pixelStates;
+    std::vector<float> orangeProb;
+    std::vector<int> ambiguousIndices;
+    std::vector<uint8_t> scaledPixels;
+    int tilesX = 0, tilesY = 0;
+    std::vector<int> tileStart;
+    std::vector<uint8_t> tileVisible;
+    std::vector<Monitor> monitors;
+    std::vector<uint8_t> owner;       // monitor index per grid pixel, 0xFF = dead zone
+};
+
+// Classify one monitor's cells and write them into the grid pixels it owns
+static void prepareMonitor(PreparedImage& out, Monitor& m, uint8_t index, const SourceImage& source) {
+    m.gx0 = m.x / out.pixelSize;
+    m.gy0 = m.y / out.pixelSize;
+    m.gx1 = std::min(out.scaledWidth, (m.x + m.width) / out.pixelSize);
+    m.gy1 = std::min(out.scaledHeight, (m.y + m.height) / out.pixelSize);
+    if (m.gx1 <= m.gx0 || m.gy1 <= m.gy0) {
+        m.cellsX = m.cellsY = 0;
         return;
     }
+    m.cellsX = (m.gx1 - m.gx0 + m.block - 1) / m.block;
+    m.cellsY = (m.gy1 - m.gy0 + m.block - 1) / m.block;
+    m.rowSine.resize(m.cellsY);
     
-    std::cout << "Loaded image: " << origWidth << "x" << origHeight << std::endl;
-    std::cout << "Screen size: " << screenWidth << "x" << screenHeight << std::endl;
-    
-    g_imgWidth = screenWidth;
-    g_imgHeight = screenHeight;
-    g_scaledWidth = g_imgWidth / g_pixelSize;
-    g_scaledHeight = g_imgHeight / g_pixelSize;
-    
-    std::cout << "Dither resolution: " << g_scaledWidth << "x" << g_scaledHeight << std::endl;
-    
-    int scaledPixels = g_scaledWidth * g_scaledHeight;
-    g_pixelStates.resize(scaledPixels);
-    g_orangeProb.resize(scaledPixels);
-    g_ambiguousIndices.clear();
-    g_ambiguousIndices.reserve(scaledPixels / 4);
-    
-
-    std::vector<float> imgFloat(scaledPixels * 3);
+    const unsigned char* data = source.data;
+    int origWidth = source.width;
+    int origHeight = source.height;
     
-
-    for (int sy = 0; sy < g_scaledHeight; sy++) {
-        for (int sx = 0; sx < g_scaledWidth; sx++) {
-            float srcX = (float)sx / g_scaledWidth * origWidth;
-            float srcY = (float)sy / g_scaledHeight * origHeight;
+    for (int cy = 0; cy < m.cellsY; cy++) {
+        for (int cx = 0; cx < m.cellsX; cx++) {
+            float srcX = (float)cx / m.cellsX * origWidth;
+            float srcY = (float)cy / m.cellsY * origHeight;
             
             int x0 = (int)srcX;
             int y0 = (int)srcY;
@@ -210,25 +619,6 @@ void loadAndPrepareImage(const char* filename, int screenWidth, int screenHeight
                 }
             }
             
-            int dstIdx = (sy * g_scaledWidth + sx) * 3;
-            imgFloat[dstIdx] = r;
-            imgFloat[dstIdx + 1] = g;
-            imgFloat[dstIdx + 2] = b;
-        }
-    }
-    
-    stbi_image_free(data);
-    
-
-    for (int y = 0; y < g_scaledHeight; y++) {
-        for (int x = 0; x < g_scaledWidth; x++) {
-            int idx = (y * g_scaledWidth + x) * 3;
-            int pixIdx = y * g_scaledWidth + x;
-            
-            float r = imgFloat[idx];
-            float g = imgFloat[idx + 1];
-            float b = imgFloat[idx + 2];
-            
             float distBlack = sqrtf(r*r + g*g + b*b);
             float distOrange = sqrtf((r-1.0f)*(r-1.0f) + (g-0.549f)*(g-0.549f) + b*b);
             
@@ -238,509 +628,3557 @@ void loadAndPrepareImage(const char* filename, int screenWidth, int screenHeight
             const float AMBIG_LOW = 0.3f;
             const float AMBIG_HIGH = 0.7f;
             
-            if (orangeProb < AMBIG_LOW) {
-                g_pixelStates[pixIdx] = PIXEL_BLACK;
-            } else if (orangeProb > AMBIG_HIGH) {
-                g_pixelStates[pixIdx] = PIXEL_ORANGE;
-            } else {
-                g_pixelStates[pixIdx] = PIXEL_AMBIGUOUS;
-                g_orangeProb[pixIdx] = orangeProb;
-                g_ambiguousIndices.push_back(pixIdx);
+            PixelState state = PIXEL_AMBIGUOUS;
+            if (orangeProb < AMBIG_LOW) state = PIXEL_BLACK;
+            else if (orangeProb > AMBIG_HIGH) state = PIXEL_ORANGE;
+            
+            // Spread the cell over its block; overlapping monitors keep the first owner
+            int gyEnd = std::min(m.gy1, m.gy0 + (cy + 1) * m.block);
+            int gxEnd = std::min(m.gx1, m.gx0 + (cx + 1) * m.block);
+            for (int gy = m.gy0 + cy * m.block; gy < gyEnd; gy++) {
+                for (int gx = m.gx0 + cx * m.block; gx < gxEnd; gx++) {
+                    int pixIdx = gy * out.scaledWidth + gx;
+                    if (out.owner[pixIdx] != 0xFF) continue;
+                    out.owner[pixIdx] = index;
+                    out.pixelStates[pixIdx] = state;
+                    out.orangeProb[pixIdx] = orangeProb;
+                }
+            }
+        }
+    }
+}
+
+// Lay out out.monitors on a screen of the given size. Touches no globals besides the
+// image cache, so it can run beside the render loop. Returns false when no image
+// could be loaded for some monitor.
+bool prepareImage(PreparedImage& out, int screenWidth, int screenHeight) {
+    std::cout << "Screen size: " << screenWidth << "x" << screenHeight << std::endl;
+    
+    out.imgWidth = screenWidth;
+    out.imgHeight = screenHeight;
+    out.scaledWidth = out.imgWidth / out.pixelSize;
+    out.scaledHeight = out.imgHeight / out.pixelSize;
+    
+    std::cout << "Dither resolution: " << out.scaledWidth << "x" << out.scaledHeight << std::endl;
+    
+    // assign() keeps the capacity of buffers swapped out by the previous relayout
+    int scaledPixels = out.scaledWidth * out.scaledHeight;
+    out.pixelStates.assign(scaledPixels, PIXEL_BLACK);
+    out.orangeProb.assign(scaledPixels, 0.0f);
+    out.owner.assign(scaledPixels, 0xFF);
+    
+    for (size_t i = 0; i < out.monitors.size() && i < 0xFF; i++) {
+        const SourceImage* source = loadSource(out.monitors[i].image);
+        if (!source && out.monitors[i].image != g_imagePath) source = loadSource(g_imagePath);
+        if (!source) return false;
+        prepareMonitor(out, out.monitors[i], (uint8_t)i, *source);
+    }
+    
+    // Monitor-major, row-major within a monitor
+    std::vector<int> ambiguous;
+    ambiguous.reserve(scaledPixels / 4);
+    for (size_t i = 0; i < out.monitors.size() && i < 0xFF; i++) {
+        const Monitor& m = out.monitors[i];
+        for (int gy = m.gy0; gy < m.gy1; gy++) {
+            for (int gx = m.gx0; gx < m.gx1; gx++) {
+                int pixIdx = gy * out.scaledWidth + gx;
+                if (out.owner[pixIdx] == i && out.pixelStates[pixIdx] == PIXEL_AMBIGUOUS) ambiguous.push_back(pixIdx);
             }
         }
     }
     
 
-    g_scaledPixels.resize(g_scaledWidth * g_scaledHeight * 4);
+    out.scaledPixels.resize(out.scaledWidth * out.scaledHeight * 4);
     
 
-    for (int y = 0; y < g_scaledHeight; y++) {
-        for (int x = 0; x < g_scaledWidth; x++) {
-            int pixIdx = y * g_scaledWidth + x;
+    for (int y = 0; y < out.scaledHeight; y++) {
+        for (int x = 0; x < out.scaledWidth; x++) {
+            int pixIdx = y * out.scaledWidth + x;
             int idx = pixIdx * 4;
-            if (g_pixelStates[pixIdx] == PIXEL_BLACK) {
-                memcpy(&g_scaledPixels[idx], BLACK_RGBA, 4);
+            if (out.pixelStates[pixIdx] == PIXEL_BLACK) {
+                memcpy(&out.scaledPixels[idx], BLACK_RGBA, 4);
             } else {
-                memcpy(&g_scaledPixels[idx], ORANGE_RGBA, 4);
+                memcpy(&out.scaledPixels[idx], ORANGE_RGBA, 4);
+            }
+        }
+    }
+    
+    // Group ambiguous pixels by tile (counting sort is stable, so inside a tile they stay
+    // grouped by monitor and row-major within it)
+    out.tilesX = (out.scaledWidth + TILE_SIZE - 1) / TILE_SIZE;
+    out.tilesY = (out.scaledHeight + TILE_SIZE - 1) / TILE_SIZE;
+    int tileCount = out.tilesX * out.tilesY;
+    out.tileStart.assign(tileCount + 1, 0);
+    for (int pixIdx : ambiguous) {
+        int tile = (pixIdx / out.scaledWidth / TILE_SIZE) * out.tilesX + (pixIdx % out.scaledWidth) / TILE_SIZE;
+        out.tileStart[tile + 1]++;
+    }
+    for (int t = 0; t < tileCount; t++) out.tileStart[t + 1] += out.tileStart[t];
+    
+    out.ambiguousIndices.resize(ambiguous.size());
+    std::vector<int> fill(out.tileStart.begin(), out.tileStart.end() - 1);
+    for (int pixIdx : ambiguous) {
+        int tile = (pixIdx / out.scaledWidth / TILE_SIZE) * out.tilesX + (pixIdx % out.scaledWidth) / TILE_SIZE;
+        out.ambiguousIndices[fill[tile]++] = pixIdx;
+    }
+    
+    // Hand each monitor its stretch of every tile
+    for (Monitor& m : out.monitors) m.spans.clear();
+    for (int t = 0; t < tileCount; t++) {
+        for (int i = out.tileStart[t]; i < out.tileStart[t + 1]; ) {
+            uint8_t index = out.owner[out.ambiguousIndices[i]];
+            int begin = i;
+            while (i < out.tileStart[t + 1] && out.owner[out.ambiguousIndices[i]] == index) i++;
+            out.monitors[index].spans.push_back({t, begin, i});
+        }
+    }
+    
+    // Tiles off every monitor are never dithered or uploaded
+    out.tileVisible.assign(tileCount, 0);
+    for (const Monitor& m : out.monitors) {
+        if (m.cellsX == 0) continue;
+        for (int ty = m.gy0 / TILE_SIZE; ty <= (m.gy1 - 1) / TILE_SIZE; ty++) {
+            for (int tx = m.gx0 / TILE_SIZE; tx <= (m.gx1 - 1) / TILE_SIZE; tx++) {
+                out.tileVisible[ty * out.tilesX + tx] = 1;
             }
         }
     }
     
-    std::cout << "Optimized: " << g_ambiguousIndices.size() << " ambiguous pixels out of " 
-              << scaledPixels << " (" << (100.0f * g_ambiguousIndices.size() / scaledPixels) << "%)" << std::endl;
+    std::cout << "Optimized: " << out.ambiguousIndices.size() << " ambiguous pixels out of " 
+              << scaledPixels << " (" << (100.0f * out.ambiguousIndices.size() / scaledPixels) << "%)" << std::endl;
+    return true;
+}
+
+// Make a prepared layout current. The old buffers end up in image, ready to be reused.
+void installImage(PreparedImage& image) {
+    // Monitors that survive the change keep animating where they were
+    for (Monitor& m : image.monitors) {
+        for (const Monitor& old : g_monitors) {
+            if (old.name != m.name) continue;
+            m.time = old.time;
+            m.seed = old.seed;
+            m.nextFrame = old.nextFrame;
+        }
+    }
+    
+    std::swap(g_pixelSize, image.pixelSize);
+    std::swap(g_imgWidth, image.imgWidth);
+    std::swap(g_imgHeight, image.imgHeight);
+    std::swap(g_scaledWidth, image.scaledWidth);
+    std::swap(g_scaledHeight, image.scaledHeight);
+    g_pixelStates.swap(image.pixelStates);
+    g_orangeProb.swap(image.orangeProb);
+    g_ambiguousIndices.swap(image.ambiguousIndices);
+    for (std::vector<uint8_t>& frame : g_frameBuffers) frame.assign(image.scaledPixels.begin(), image.scaledPixels.end());
+    g_scaledPixels = g_frameBuffers[0].data();
+    std::swap(g_tilesX, image.tilesX);
+    std::swap(g_tilesY, image.tilesY);
+    g_tileStart.swap(image.tileStart);
+    g_tileVisible.swap(image.tileVisible);
+    g_monitors.swap(image.monitors);
+    // Frames ahead hold states of the old layout, even when its pixel count is the same
+    seedLookahead();
 }
 
 /*
  * Dithering Animation
  */
-void ditherFrame() {
-    if (g_algorithm == 0) return;  // Static - no animation
+std::vector<uint8_t> g_ditherVisible;  // the dithering thread's copy of g_tileVisible
+
+// Frames are dithered into one state byte per ambiguous pixel (1 = orange), indexed like
+// g_ambiguousIndices; a frame on its way to the screen is expanded into RGBA.
+// A monitor that sits a frame out keeps the states of the last frame it produced.
+static void copySpan(const TileSpan& span, uint8_t* states, const uint8_t* previous) {
+    memcpy(&states[span.begin], &previous[span.begin], span.end - span.begin);
+}
+
+static void expandSpan(int begin, int end, const uint8_t* states, uint8_t* pixels) {
+    for (int i = begin; i < end; i++) {
+        memcpy(&pixels[g_ambiguousIndices[i] * 4], states[i] ? ORANGE_RGBA : BLACK_RGBA, 4);
+    }
+}
+
+static void beginMonitorFrame(Monitor& m) {
+    if (g_algorithm == 2) {
+        for (int y = 0; y < m.cellsY; y++) {
+            m.rowSine[y] = sinf(y * 0.8f - m.time * 2.0f);
+        }
+    }
+    m.seed = m.seed * 1664525u + 1013904223u;
+}
+
+static void ditherSpan(const Monitor& m, const TileSpan& span, uint8_t* states) {
+    float chaos = g_chaos / 100.0f;
+    float invWidth = 2.0f / m.cellsX;
     
-    for (int pixIdx : g_ambiguousIndices) {
-        int idx = pixIdx * 4;
+    for (int i = span.begin; i < span.end; i++) {
+        int pixIdx = g_ambiguousIndices[i];
+        
+        // Cell coordinates inside the monitor
+        int x = pixIdx % g_scaledWidth - m.gx0;
+        int y = pixIdx / g_scaledWidth - m.gy0;
+        if (m.block > 1) {
+            x /= m.block;
+            y /= m.block;
+        }
+        float random = cellRandFloat((uint32_t)(y * m.cellsX + x), m.seed);
         bool isOrange;
         
         if (g_algorithm == 1) {
             // Random
-            isOrange = fastRandFloat() < g_orangeProb[pixIdx];
+            isOrange = random < g_orangeProb[pixIdx];
         } else {
             // Wave with chaos blend
-            int x = pixIdx % g_scaledWidth;
-            int y = pixIdx / g_scaledWidth;
-            
-            static int lastY = -1;
-            static float cachedSine = 0.0f;
-            static float cachedChaos = 0.0f;
-            static float invWidth = 0.0f;
-            
-            if (y != lastY) {
-                float wavePhase = y * 0.8f - g_time * 2.0f;
-                cachedSine = sinf(wavePhase);
-                cachedChaos = g_chaos / 100.0f;
-                invWidth = 2.0f / g_scaledWidth;
-                lastY = y;
-            }
-            
             float normalizedX = x * invWidth - 1.0f;
-            float waveThreshold = g_orangeProb[pixIdx] + (normalizedX - cachedSine) * 0.3f;
+            float waveThreshold = g_orangeProb[pixIdx] + (normalizedX - m.rowSine[y]) * 0.3f;
             
-            if (cachedChaos > 0.0f) {
-                float randomThreshold = g_orangeProb[pixIdx] + (fastRandFloat() - 0.5f) * 0.4f;
-                waveThreshold = waveThreshold * (1.0f - cachedChaos) + randomThreshold * cachedChaos;
+            if (chaos > 0.0f) {
+                float randomThreshold = g_orangeProb[pixIdx] + (random - 0.5f) * 0.4f;
+                waveThreshold = waveThreshold * (1.0f - chaos) + randomThreshold * chaos;
             }
             
             isOrange = waveThreshold > 0.5f;
         }
         
-        memcpy(&g_scaledPixels[idx], isOrange ? ORANGE_RGBA : BLACK_RGBA, 4);
+        states[i] = isOrange;
     }
-    
-    g_time += 0.016f;
 }
 
 /*
- * Windows Implementation
+ * Core Classes
  */
-#if PLATFORM_WINDOWS
+// Hybrid CPUs mix cores of different capacity. Class 0 holds the slowest cores; anything
+// else has a single class. Dithering and presenting are costed by the class of the core
+// they ran on, so the profile shows whether the efficiency cores keep up.
+const int MAX_CORE_CLASSES = 3;
+std::vector<int> g_coreClass;          // class of each CPU number, -1 if offline
+int g_coreClasses = 1;
+bool g_cpuAccounting = false;          // measure thread CPU time: CPU governor or hybrid profile
+struct CoreCost {
+    std::atomic<long long> ditherUs{0};
+    std::atomic<int> ditherRuns{0};    // monitors dithered
+    long long presentUs = 0;           // main thread only
+    int presentFrames = 0;
+};
+CoreCost g_coreCosts[MAX_CORE_CLASSES];
 
-BOOL CALLBACK FindWorkerWEnumProc(HWND hwnd, LPARAM lParam) {
-    HWND* pTarget = reinterpret_cast<HWND*>(lParam);
-    char className[256];
-    GetClassNameA(hwnd, className, 256);
-    if (strcmp(className, "WorkerW") == 0) {
-        *pTarget = hwnd;
-        return FALSE;
-    }
-    return TRUE;
+static int currentCoreClass() {
+    int cpu = platformCurrentCpu();
+    return cpu >= 0 && cpu < (int)g_coreClass.size() ? std::max(0, g_coreClass[cpu]) : 0;
 }
 
-BOOL CALLBACK FindShellViewEnumProc(HWND hwnd, LPARAM lParam) {
-    HWND* pTarget = reinterpret_cast<HWND*>(lParam);
-    char className[256];
-    GetClassNameA(hwnd, className, 256);
-    if (strcmp(className, "SHELLDLL_DefView") == 0) {
-        *pTarget = hwnd;
-        return FALSE;
-    }
-    return TRUE;
+static const char* coreClassName(int coreClass) {
+    if (coreClass == 0) return "efficiency";
+    return coreClass == g_coreClasses - 1 ? "performance" : "mid";
 }
 
-LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
-    switch (msg) {
-    case WM_DESTROY:
-        wglMakeCurrent(NULL, NULL);
-        wglDeleteContext(g_hRC);
-        ReleaseDC(hwnd, g_hDC);
-        PostQuitMessage(0);
-        g_running = false;
-        return 0;
-    case WM_KEYDOWN:
-        if (wParam == VK_ESCAPE) {
-            DestroyWindow(hwnd);
-        }
-        return 0;
+// CPU list in the kernel's format: 0-3,8
+std::vector<int> parseCpuList(const char* list) {
+    std::vector<int> cpus;
+    for (const char* item = list; *item; ) {
+        char* end;
+        int first = (int)strtol(item, &end, 10);
+        if (end == item) break;
+        int last = *end == '-' ? (int)strtol(end + 1, &end, 10) : first;
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        if (*end != ',') break;
+        item = end + 1;
     }
-    return DefWindowProc(hwnd, msg, wParam, lParam);
+    return cpus;
 }
 
-void platformInit(int& screenWidth, int& screenHeight) {
-    SetProcessDPIAware();
-    
-    HDC hdc = GetDC(nullptr);
-    screenWidth = GetDeviceCaps(hdc, HORZRES);
-    screenHeight = GetDeviceCaps(hdc, VERTRES);
-    ReleaseDC(nullptr, hdc);
-    
-    g_hProgman = FindWindowA("Progman", nullptr);
-    SendMessageTimeout(g_hProgman, 0x052C, 0, 0, SMTO_NORMAL, 100, nullptr);
-    
-    EnumChildWindows(g_hProgman, FindShellViewEnumProc, (LPARAM)&g_hShellView);
-    EnumChildWindows(g_hProgman, FindWorkerWEnumProc, (LPARAM)&g_hWorkerW);
-    
-    WNDCLASSA wc = {};
-    wc.lpfnWndProc = WndProc;
-    wc.hInstance = GetModuleHandle(nullptr);
-    wc.lpszClassName = "LiveDitherBG";
-    wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
-    RegisterClassA(&wc);
-    
-    DWORD exStyle = WS_EX_LAYERED | WS_EX_NOACTIVATE | WS_EX_TOOLWINDOW;
-    
-    g_hMyWallpaper = CreateWindowExA(
-        exStyle, "LiveDitherBG", "LiveDitherBG",
-        WS_POPUP | WS_VISIBLE | WS_CLIPCHILDREN | WS_CLIPSIBLINGS,
-        0, 0, screenWidth, screenHeight,
-        nullptr, nullptr, wc.hInstance, nullptr
-    );
-    
-    if (g_hMyWallpaper) {
-        SetParent(g_hMyWallpaper, g_hProgman);
-        SetWindowLong(g_hMyWallpaper, GWL_STYLE, WS_CHILD | WS_VISIBLE | WS_CLIPCHILDREN | WS_CLIPSIBLINGS);
-        SetLayeredWindowAttributes(g_hMyWallpaper, 0, 255, LWA_ALPHA);
-        SetWindowPos(g_hMyWallpaper, g_hShellView, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
-        if (g_hWorkerW) SetWindowPos(g_hWorkerW, g_hMyWallpaper, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
-    } else {
-        std::cerr << "Failed to create window." << std::endl;
-        exit(1);
+// The CPUs --cores asks for, or none to leave the affinity alone
+std::vector<int> selectedCores() {
+    std::vector<int> cpus;
+    if (strcmp(g_cores, "auto") == 0 || strcmp(g_cores, "efficient") == 0) {
+        for (size_t cpu = 0; cpu < g_coreClass.size() && g_coreClasses > 1; cpu++) {
+            if (g_coreClass[cpu] == 0) cpus.push_back((int)cpu);
+        }
+    } else if (strcmp(g_cores, "all") != 0) {
+        cpus = parseCpuList(g_cores);
     }
-    
-    g_hDC = GetDC(g_hMyWallpaper);
-    
-    PIXELFORMATDESCRIPTOR pfd = {};
-    pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
-    pfd.nVersion = 1;
-    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
-    pfd.iPixelType = PFD_TYPE_RGBA;
-    pfd.cColorBits = 32;
-    pfd.cDepthBits = 24;
-    pfd.iLayerType = PFD_MAIN_PLANE;
-    
-    int format = ChoosePixelFormat(g_hDC, &pfd);
-    SetPixelFormat(g_hDC, format, &pfd);
-    
-    g_hRC = wglCreateContext(g_hDC);
-    wglMakeCurrent(g_hDC, g_hRC);
-    
-    glViewport(0, 0, screenWidth, screenHeight);
-    
-    glGenTextures(1, &g_textureID);
-    glBindTexture(GL_TEXTURE_2D, g_textureID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glEnable(GL_TEXTURE_2D);
-    
-    timeBeginPeriod(1);
+    return cpus;
 }
 
-void platformRender() {
-    glBindTexture(GL_TEXTURE_2D, g_textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, g_scaledWidth, g_scaledHeight, 0,
-                 GL_RGBA, GL_UNSIGNED_BYTE, g_scaledPixels.data());
-    
-    glClear(GL_COLOR_BUFFER_BIT);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, -1.0f);
-    glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, -1.0f);
-    glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, 1.0f);
-    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, 1.0f);
-    glEnd();
-    
-    SwapBuffers(g_hDC);
+void recordPresentCost(double cpuStart) {
+    if (!g_cpuAccounting) return;
+    CoreCost& cost = g_coreCosts[currentCoreClass()];
+    cost.presentUs += (long long)((platformThreadCpuTime() - cpuStart) * 1000000.0);
+    cost.presentFrames++;
 }
 
-void platformPollEvents() {
-    MSG msg;
-    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
-        if (msg.message == WM_QUIT) g_running = false;
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+// Average cost per dithered monitor and per presented frame on each class since the last call
+std::string coreCostStats() {
+    std::string stats;
+    for (int c = 0; c < g_coreClasses; c++) {
+        CoreCost& cost = g_coreCosts[c];
+        long long ditherUs = cost.ditherUs.exchange(0);
+        int ditherRuns = cost.ditherRuns.exchange(0);
+        if (ditherRuns == 0 && cost.presentFrames == 0) continue;
+        char line[128];
+        snprintf(line, sizeof(line), " | %s: dither %.2f ms x%d, present %.2f ms x%d", coreClassName(c),
+                 ditherRuns ? ditherUs / 1000.0 / ditherRuns : 0.0, ditherRuns,
+                 cost.presentFrames ? cost.presentUs / 1000.0 / cost.presentFrames : 0.0, cost.presentFrames);
+        stats += line;
+        cost.presentUs = 0;
+        cost.presentFrames = 0;
     }
+    return stats;
 }
 
-void platformCleanup() {
-    timeEndPeriod(1);
+/*
+ * Monitor Workers
+ */
+// Monitors are dealt out round-robin over the frame producer (thread 0) and the workers,
+// one thread per monitor as long as the process has a CPU for each
+std::vector<std::thread> g_workers;
+size_t g_ditherThreads = 1;            // the producer and the workers
+std::mutex g_workMutex;
+std::condition_variable g_workStart;
+std::condition_variable g_workDone;
+unsigned g_workGeneration = 0;
+int g_workPending = 0;
+bool g_workersExit = false;
+uint8_t* g_workStates = nullptr;       // frame being dithered, set before each generation
+const uint8_t* g_workPrevious = nullptr;
+uint8_t* g_workPixels = nullptr;       // RGBA to expand it into as it goes, null for lookahead
+unsigned g_flipPhase = 0;              // which tile rows a partial flip rate re-dithers
+std::unique_ptr<std::atomic<int>[]> g_rowsDone;  // tile rows each monitor has finished
+std::atomic<int> g_frameDiffers(-1);   // frame being handed over differs from the last, -1 = not known yet
+std::mutex g_bandMutex;
+std::condition_variable g_bandDone;
+std::atomic<long long> g_ditherCpuUs(0);  // CPU time the dithering threads spent, for the governor
+
+// Let the presenter upload everything above tile row rows
+static void finishRows(size_t index, int rows) {
+    g_rowsDone[index].store(rows, std::memory_order_release);
+    {
+        // Pairs with the presenter checking the row counts under the lock
+        std::lock_guard<std::mutex> lock(g_bandMutex);
+    }
+    g_bandDone.notify_one();
 }
 
-double platformGetTime() {
-    static LARGE_INTEGER freq = {};
-    static LARGE_INTEGER start = {};
-    if (freq.QuadPart == 0) {
-        QueryPerformanceFrequency(&freq);
-        QueryPerformanceCounter(&start);
+// Known before the first row, so the presenter can skip an unchanged frame instead of
+// uploading it band by band
+static void publishFrameDiffers(bool differs) {
+    g_frameDiffers.store(differs, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(g_bandMutex);
     }
-    LARGE_INTEGER now;
-    QueryPerformanceCounter(&now);
-    return (double)(now.QuadPart - start.QuadPart) / freq.QuadPart;
+    g_bandDone.notify_one();
 }
 
-void platformSleep(int ms) {
-    Sleep(ms);
+// CPU the calling thread spent since cpuStart; runs is the number of monitors it dithered
+static void recordDitherCost(double cpuStart, int runs) {
+    long long us = (long long)((platformThreadCpuTime() - cpuStart) * 1000000.0);
+    g_ditherCpuUs += us;
+    CoreCost& cost = g_coreCosts[currentCoreClass()];
+    cost.ditherUs += us;
+    cost.ditherRuns += runs;
+}
+
+// Spans come in tile order, so a monitor is done with a row once it reaches the next one.
+// Only a frame expanded as it is dithered reports rows; lookahead frames go unseen until later.
+// With a flip rate below 100%, due monitors re-dither every Nth tile row in turn and keep the rest.
+static void runMonitor(size_t index) {
+    Monitor& m = g_monitors[index];
+    double cpuStart = g_cpuAccounting ? platformThreadCpuTime() : 0.0;
+    if (m.due) beginMonitorFrame(m);
+    int flipPeriod = std::max(1, (100 + g_flipPercent / 2) / g_flipPercent);
+    int row = 0;
+    for (const TileSpan& span : m.spans) {
+        int spanRow = span.tile / g_tilesX;
+        if (spanRow > row) {
+            if (g_workPixels) finishRows(index, spanRow);
+            row = spanRow;
+        }
+        if (!g_ditherVisible[span.tile]) continue;
+        if (m.due && (spanRow + g_flipPhase) % flipPeriod == 0) {
+            ditherSpan(m, span, g_workStates);
+        } else {
+            copySpan(span, g_workStates, g_workPrevious);
+        }
+        if (g_workPixels) expandSpan(span.begin, span.end, g_workStates, g_workPixels);
+    }
+    if (m.due) m.time += 0.016f;
+    if (g_cpuAccounting) recordDitherCost(cpuStart, 1);
+    if (g_workPixels) finishRows(index, g_tilesY);
+}
+
+static void runMonitors(size_t thread) {
+    for (size_t i = thread; i < g_monitors.size(); i += g_ditherThreads) runMonitor(i);
+}
+
+static void workerMain(size_t thread) {
+    if (g_background) platformLowerThreadPriority();
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(g_workMutex);
+            g_workStart.wait(lock, [&] { return g_workersExit || g_workGeneration != seen; });
+            if (g_workersExit) return;
+            seen = g_workGeneration;
+        }
+        runMonitors(thread);
+        {
+            std::lock_guard<std::mutex> lock(g_workMutex);
+            g_workPending--;
+        }
+        g_workDone.notify_one();
+    }
+}
+
+void startWorkers() {
+    g_workersExit = false;
+    g_ditherThreads = std::max<size_t>(1, std::min(g_monitors.size(), (size_t)g_cpuLimit));
+    for (size_t i = 1; i < g_ditherThreads; i++) g_workers.emplace_back(workerMain, i);
+}
+
+void stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(g_workMutex);
+        g_workersExit = true;
+    }
+    g_workStart.notify_all();
+    for (std::thread& worker : g_workers) worker.join();
+    g_workers.clear();
+}
+
+// Dither the frame shown at frameTime into states; previous is the frame before it. With
+// pixels, it is expanded into them as it goes. False when no monitor was due, so the frame
+// is the same as the previous one.
+bool ditherFrame(uint8_t* states, const uint8_t* previous, uint8_t* pixels, double frameTime) {
+    if (g_algorithm == 0) {
+        // Static - no animation
+        for (size_t i = 0; i < g_monitors.size(); i++) finishRows(i, g_tilesY);
+        return false;
+    }
+    
+    // Monitors with their own rate sit out frames until they are due
+    for (Monitor& m : g_monitors) {
+        m.due = m.cellsX > 0;
+        if (!m.due || m.fps <= 0) continue;
+        if (frameTime + 0.002 < m.nextFrame) {
+            m.due = false;
+        } else {
+            m.nextFrame = std::max(m.nextFrame + 1.0 / m.fps, frameTime);
+        }
+    }
+    bool changed = false;
+    for (const Monitor& m : g_monitors) changed |= m.due && !m.spans.empty();
+    if (pixels) publishFrameDiffers(changed);
+    
+    {
+        std::lock_guard<std::mutex> lock(g_workMutex);
+        g_workStates = states;
+        g_workPrevious = previous;
+        g_workPixels = pixels;
+        g_flipPhase++;
+        g_workPending = (int)g_workers.size();
+        g_workGeneration++;
+    }
+    g_workStart.notify_all();
+    
+    runMonitors(0);
+    
+    if (!g_workers.empty()) {
+        std::unique_lock<std::mutex> lock(g_workMutex);
+        g_workDone.wait(lock, [] { return g_workPending == 0; });
+    }
+    return changed;
+}
+
+/*
+ * Frame Producer
+ */
+// Dithering runs on a thread of its own while the main thread uploads the previous frame,
+// so a frame costs max(dither, upload) instead of their sum. The three frame buffers
+// rotate without locks: the producer fills the back buffer and exchanges it into the
+// middle slot with the fresh bit set, the presenter exchanges its front buffer for a
+// fresh middle one. The mutex and condition variables only park idle threads.
+const int FRAME_FRESH = 4;
+std::atomic<int> g_middleFrame(1);
+int g_backFrame = 2;                   // producer only
+int g_frontFrame = 0;                  // presenter only
+int g_producingFrame = 2;              // presenter's note of the buffer being filled
+std::thread g_producer;
+std::mutex g_produceMutex;
+std::condition_variable g_produceStart;
+std::condition_variable g_produceDone;
+bool g_produceRequested = false;
+bool g_producerExit = false;
+int g_producerWaits = 0;               // frames the presenter had to wait for
+bool g_frameChanged[3] = {};           // set by the producer before it publishes the buffer
+std::vector<uint8_t> g_frameVisible[3]; // tiles each buffer was dithered with, set before its first row
+std::vector<uint8_t> g_renderVisible;   // presenter: tiles the frame on its way can show
+bool g_redrawNeeded = true;            // the screen lost content only a full render restores
+int g_unchangedFrames = 0;
+std::vector<uint8_t> g_requestVisible; // visibility handed over with the last request
+bool g_visibilityPending = false;
+
+// Lookahead: the animation is deterministic, so while the presenter sleeps until its
+// deadline the producer dithers up to --lookahead frames ahead into a ring of state
+// frames. Handing one over is then just its expansion into RGBA, and a frame that takes
+// too long (an image swap, a CPU spike) eats into the ring instead of the deadline.
+// Each slot keeps the monitor clocks from before it was dithered, so frames that become
+// invalid (newly uncovered tiles were skipped, the producer restarts with new settings)
+// are dropped and dithered again from the same point in the animation.
+struct MonitorClock {
+    float time;
+    uint32_t seed;
+    double nextFrame;
+};
+struct AheadFrame {
+    std::vector<uint8_t> states;
+    std::vector<MonitorClock> clocks;  // monitor clocks before this frame
+    unsigned flipPhase = 0;
+    double time = 0.0;                 // when it is expected on screen
+    bool changed = false;
+};
+std::vector<AheadFrame> g_aheadFrames; // producer only, lookahead + 1 slots
+int g_aheadHead = 0;                   // oldest frame not handed over yet
+int g_aheadCount = 0;
+int g_aheadLast = 0;                   // the frame handed over last
+std::atomic<int> g_aheadLow(0);        // fewest frames ahead at a handover since the last reset
+std::atomic<double> g_framePeriod(1.0 / 60.0);  // presenter's recent frame interval
+double g_lastAcquire = 0.0;            // presenter only
+
+// The ring starts out as copies of the installed frame, so the first frames can copy
+// states of monitors that are not due yet
+void seedLookahead() {
+    std::vector<uint8_t> states(g_ambiguousIndices.size());
+    for (size_t i = 0; i < states.size(); i++) {
+        states[i] = memcmp(&g_frameBuffers[0][g_ambiguousIndices[i] * 4], ORANGE_RGBA, 4) == 0;
+    }
+    g_aheadFrames.assign(std::max(2, g_lookahead + 1), AheadFrame());
+    for (AheadFrame& frame : g_aheadFrames) frame.states = states;
+    g_aheadHead = 1;
+    g_aheadCount = 0;
+    g_aheadLast = 0;
+}
+
+// Forget the frames ahead and put the monitors back where the oldest of them started
+static void rewindLookahead() {
+    if (g_aheadCount == 0) return;
+    const AheadFrame& oldest = g_aheadFrames[g_aheadHead];
+    for (size_t i = 0; i < g_monitors.size(); i++) {
+        g_monitors[i].time = oldest.clocks[i].time;
+        g_monitors[i].seed = oldest.clocks[i].seed;
+        g_monitors[i].nextFrame = oldest.clocks[i].nextFrame;
+    }
+    g_flipPhase = oldest.flipPhase;
+    g_aheadCount = 0;
+}
+
+static bool lookaheadRoom() {
+    return g_algorithm != 0 && g_aheadCount < g_lookahead;
+}
+
+// Dither the frame after the newest one into the next free slot. With pixels it is
+// handed over right away, expanded while it is dithered; without, it joins the ring.
+static bool produceFrame(uint8_t* pixels) {
+    int size = (int)g_aheadFrames.size();
+    int slot = (g_aheadHead + g_aheadCount) % size;
+    int previous = g_aheadCount ? (slot + size - 1) % size : g_aheadLast;
+    AheadFrame& frame = g_aheadFrames[slot];
+    double now = platformGetTime();
+    frame.time = pixels ? now : std::max(now, g_aheadFrames[previous].time + g_framePeriod.load());
+    frame.clocks.resize(g_monitors.size());
+    for (size_t i = 0; i < g_monitors.size(); i++) {
+        frame.clocks[i] = {g_monitors[i].time, g_monitors[i].seed, g_monitors[i].nextFrame};
+    }
+    frame.flipPhase = g_flipPhase;
+    frame.changed = ditherFrame(frame.states.data(), g_aheadFrames[previous].states.data(), pixels, frame.time);
+    if (pixels) {
+        g_aheadLast = slot;
+        g_aheadHead = (slot + 1) % size;
+    } else {
+        g_aheadCount++;
+    }
+    return frame.changed;
+}
+
+static void finishAllRows(int rows) {
+    for (size_t i = 0; i < g_monitors.size(); i++) g_rowsDone[i].store(rows, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(g_bandMutex);
+    }
+    g_bandDone.notify_one();
+}
+
+// Hand the oldest frame ahead over, a tile row at a time so bands can follow it up
+static bool expandAheadFrame(uint8_t* pixels) {
+    const AheadFrame& frame = g_aheadFrames[g_aheadHead];
+    publishFrameDiffers(frame.changed);
+    for (int ty = 0; ty < g_tilesY; ty++) {
+        for (int t = ty * g_tilesX; t < (ty + 1) * g_tilesX; t++) {
+            if (g_ditherVisible[t]) expandSpan(g_tileStart[t], g_tileStart[t + 1], frame.states.data(), pixels);
+        }
+        finishAllRows(ty + 1);
+    }
+    g_aheadLast = g_aheadHead;
+    g_aheadHead = (g_aheadHead + 1) % (int)g_aheadFrames.size();
+    g_aheadCount--;
+    return frame.changed;
+}
+
+// The new visibility applies from the next handover on. Frames ahead skipped the tiles
+// it uncovers, so they are dithered again.
+static void takeVisibility() {
+    bool uncovered = false;
+    for (size_t t = 0; t < g_requestVisible.size() && !uncovered; t++) {
+        uncovered = g_requestVisible[t] && !g_ditherVisible[t];
+    }
+    g_ditherVisible.swap(g_requestVisible);
+    if (uncovered) rewindLookahead();
+}
+
+static void producerMain() {
+    if (g_background) platformLowerThreadPriority();
+    for (;;) {
+        bool requested;
+        {
+            std::unique_lock<std::mutex> lock(g_produceMutex);
+            g_produceStart.wait(lock, [] { return g_producerExit || g_produceRequested || lookaheadRoom(); });
+            if (g_producerExit) return;
+            requested = g_produceRequested;
+            g_produceRequested = false;
+            if (g_visibilityPending) {
+                takeVisibility();
+                g_visibilityPending = false;
+            }
+        }
+        if (!requested) {
+            produceFrame(nullptr);
+            continue;
+        }
+        
+        uint8_t* pixels = g_frameBuffers[g_backFrame].data();
+        g_frameVisible[g_backFrame] = g_ditherVisible;
+        if (g_algorithm == 0) {
+            g_frameChanged[g_backFrame] = ditherFrame(nullptr, nullptr, pixels, 0.0);
+        } else if (g_aheadCount > 0) {
+            g_aheadLow = std::min(g_aheadLow.load(), g_aheadCount);
+            // Its monitors were counted when they were dithered; the expansion adds to their cost
+            double cpuStart = g_cpuAccounting ? platformThreadCpuTime() : 0.0;
+            g_frameChanged[g_backFrame] = expandAheadFrame(pixels);
+            if (g_cpuAccounting) recordDitherCost(cpuStart, 0);
+        } else {
+            // Ran dry: dither straight into the frame, bands follow it up as it goes
+            g_aheadLow = 0;
+            g_frameChanged[g_backFrame] = produceFrame(pixels);
+        }
+        int published = g_backFrame;
+        g_backFrame = g_middleFrame.exchange(published | FRAME_FRESH, std::memory_order_acq_rel) & 3;
+        {
+            // Pairs with the presenter checking the fresh bit under the lock
+            std::lock_guard<std::mutex> lock(g_produceMutex);
+        }
+        g_produceDone.notify_one();
+    }
+}
+
+// The producer may be busy with a frame ahead, so visibility is handed over instead of
+// copied in place. The buffer it fills next is the one neither the presenter nor the
+// middle slot holds; the middle slot can't change before this request is served.
+static void requestFrame() {
+    std::lock_guard<std::mutex> lock(g_produceMutex);
+    g_requestVisible = g_tileVisible;
+    g_visibilityPending = true;
+    g_producingFrame = 3 - g_frontFrame - (g_middleFrame.load(std::memory_order_acquire) & 3);
+    for (size_t i = 0; i < g_monitors.size(); i++) g_rowsDone[i].store(0, std::memory_order_relaxed);
+    g_frameDiffers.store(-1, std::memory_order_relaxed);
+    g_produceRequested = true;
+    g_produceStart.notify_one();
+}
+
+void startProducer() {
+    g_middleFrame = 1;
+    g_backFrame = 2;
+    g_frontFrame = 0;
+    g_scaledPixels = g_frameBuffers[0].data();
+    g_producerExit = false;
+    g_produceRequested = false;
+    g_rowsDone.reset(new std::atomic<int>[g_monitors.size()]);
+    g_ditherVisible = g_tileVisible;
+    for (std::vector<uint8_t>& visible : g_frameVisible) visible = g_tileVisible;
+    g_renderVisible = g_tileVisible;
+    g_aheadLow = g_lookahead;
+    g_producer = std::thread(producerMain);
+    requestFrame();
+}
+
+// Frames ahead were dithered with the settings being replaced, so they are dropped
+void stopProducer() {
+    {
+        std::lock_guard<std::mutex> lock(g_produceMutex);
+        g_producerExit = true;
+    }
+    g_produceStart.notify_one();
+    g_producer.join();
+    rewindLookahead();
+}
+
+static bool frameFresh() {
+    return (g_middleFrame.load(std::memory_order_acquire) & FRAME_FRESH) != 0;
+}
+
+// Take the newest frame and start on the next one while it is uploaded
+static void acquireFrame() {
+    if (!frameFresh()) {
+        std::unique_lock<std::mutex> lock(g_produceMutex);
+        g_produceDone.wait(lock, frameFresh);
+    }
+    g_frontFrame = g_middleFrame.exchange(g_frontFrame, std::memory_order_acq_rel) & 3;
+    g_scaledPixels = g_frameBuffers[g_frontFrame].data();
+    
+    // Frames ahead are timed by the recent frame interval; pauses don't count
+    double now = platformGetTime();
+    double interval = now - g_lastAcquire;
+    if (interval < 0.25) g_framePeriod = g_framePeriod * 0.9 + interval * 0.1;
+    g_lastAcquire = now;
+    requestFrame();
+}
+
+// A frame only holds the tiles that were visible when it was requested. Tiles uncovered
+// since then wait for the next frame, which is requested with them visible.
+static void useFrameVisibility(int frame) {
+    const std::vector<uint8_t>& dithered = g_frameVisible[frame];
+    bool changed = false;
+    for (size_t t = 0; t < g_tileVisible.size(); t++) {
+        uint8_t visible = g_tileVisible[t] && dithered[t];
+        if (g_tileVisible[t] && !dithered[t]) g_redrawNeeded = true;
+        if (visible != g_renderVisible[t]) {
+            g_renderVisible[t] = visible;
+            changed = true;
+        }
+    }
+    if (changed) platformTilesChanged();
+}
+
+static bool rowsReady(int rows) {
+    for (size_t i = 0; i < g_monitors.size(); i++) {
+        if (g_rowsDone[i].load(std::memory_order_acquire) < rows) return false;
+    }
+    return true;
+}
+
+// Upload and show the next frame. When the producer is still busy with it, each band
+// goes to the screen as soon as its rows are dithered, while the rest is computed.
+// Bands only read rows the producer has finished with.
+// A frame identical to the one on screen is skipped, unless damage needs a redraw.
+void presentNextFrame() {
+    bool redraw = g_redrawNeeded;
+    g_redrawNeeded = false;
+    
+    if (!frameFresh()) {
+        g_producerWaits++;
+        if (g_bands > 1 && g_algorithm != 0 && g_frameDiffers.load(std::memory_order_acquire) < 0) {
+            std::unique_lock<std::mutex> lock(g_bandMutex);
+            g_bandDone.wait(lock, [] { return g_frameDiffers.load(std::memory_order_acquire) >= 0; });
+        }
+        if (g_bands > 1 && g_algorithm != 0 && (g_frameDiffers.load(std::memory_order_acquire) || redraw)) {
+            g_scaledPixels = g_frameBuffers[g_producingFrame].data();
+            useFrameVisibility(g_producingFrame);
+            int rowsPerBand = (g_tilesY + g_bands - 1) / g_bands;
+            for (int row0 = 0; row0 < g_tilesY; row0 += rowsPerBand) {
+                int row1 = std::min(row0 + rowsPerBand, g_tilesY);
+                if (!rowsReady(row1)) {
+                    std::unique_lock<std::mutex> lock(g_bandMutex);
+                    g_bandDone.wait(lock, [row1] { return rowsReady(row1); });
+                }
+                platformRenderBand(row0, row1);
+            }
+            acquireFrame();  // the buffer just uploaded, once the producer hands it over
+            platformPresent();
+            return;
+        }
+    }
+    
+    acquireFrame();
+    useFrameVisibility(g_frontFrame);
+    if (!g_frameChanged[g_frontFrame] && !redraw) {
+        g_unchangedFrames++;
+        platformSkipFrame();
+        return;
+    }
+    platformRenderBand(0, g_tilesY);
+    platformPresent();
+}
+
+/*
+ * Live Relayout
+ */
+// The next layout is prepared on a thread of its own while the current one keeps animating
+std::thread g_prepareThread;
+std::atomic<bool> g_prepareFinished(false);
+bool g_prepareRunning = false;
+bool g_prepareOk = false;
+PreparedImage g_nextImage;            // holds the previous layout's buffers between relayouts
+
+void beginRelayout(std::vector<Monitor>& monitors, int screenWidth, int screenHeight, int pixelSize) {
+    g_nextImage.monitors.swap(monitors);
+    g_nextImage.pixelSize = pixelSize;
+    g_prepareRunning = true;
+    g_prepareFinished = false;
+    g_prepareThread = std::thread([screenWidth, screenHeight] {
+        g_prepareOk = prepareImage(g_nextImage, screenWidth, screenHeight);
+        g_prepareFinished = true;
+    });
+}
+
+// Swap a finished layout in between frames. True when screen-sized resources must follow.
+bool finishRelayout() {
+    if (!g_prepareRunning || !g_prepareFinished) return false;
+    g_prepareThread.join();
+    g_prepareRunning = false;
+    if (!g_prepareOk) {
+        std::cerr << "Relayout failed, keeping the current layout" << std::endl;
+        return false;
+    }
+    
+    stopProducer();
+    stopWorkers();
+    installImage(g_nextImage);
+    startWorkers();
+    startProducer();
+    return true;
+}
+
+/*
+ * Power Policy
+ */
+// Battery and thermal state pick one of these profiles. Unset fields fall back to the
+// command line, so a profile --power-profile doesn't set is the configuration as given.
+enum PowerState { POWER_AC, POWER_BATTERY, POWER_LOW, POWER_HOT, POWER_STATES };
+const char* POWER_STATE_NAMES[POWER_STATES] = {"ac", "battery", "low", "hot"};
+const double POWER_POLL_INTERVAL = 5.0;   // seconds; sysfs has no change events for these
+const int HOT_HYSTERESIS = 5;             // degrees C below hot_temp before leaving the hot profile
+const int BACKGROUND_SLACK_US = 5000;     // timer slack of profiles that set none, in background mode
+
+struct PowerProfile {
+    int fps = -1;             // FPS limit, -1 = none, 0 = pause
+    int pixelSize = 0;        // 0 = pixel_size argument
+    int algorithm = -1;       // -1 = algorithm argument
+    int flip = 0;             // percent of tile rows re-dithered per frame, 0 = all
+    int slackUs = -1;         // timer slack of the main loop, -1 = system default
+};
+PowerProfile g_powerProfiles[POWER_STATES];
+int g_powerState = POWER_AC;
+double g_lastPowerPoll = -1.0;
+
+// Fill in the fields profiles leave to the command line
+void resolvePowerProfiles() {
+    bool configured = false;
+    for (const PowerProfile& profile : g_powerProfiles) {
+        configured = configured || profile.fps >= 0 || profile.pixelSize > 0 || profile.algorithm >= 0 ||
+                     profile.flip > 0 || profile.slackUs >= 0;
+    }
+    // With every profile the configuration as given, there is nothing to switch between
+    if (!configured) g_powerPolicy = 0;
+    for (PowerProfile& profile : g_powerProfiles) {
+        if (profile.pixelSize <= 0) profile.pixelSize = g_pixelSize;
+        if (profile.algorithm < 0 || profile.algorithm > 2) profile.algorithm = g_algorithm;
+        if (profile.flip <= 0 || profile.flip > 100) profile.flip = 100;
+        if (profile.slackUs < 0 && g_background) profile.slackUs = BACKGROUND_SLACK_US;
+    }
+}
+
+const PowerProfile& currentPowerProfile() {
+    return g_powerProfiles[g_powerState];
+}
+
+// The main loop picks the rest of the profile up through applyOperatingPoint()
+static void applyPowerProfile(int state) {
+    const PowerProfile& profile = g_powerProfiles[state];
+    g_powerState = state;
+    platformSetTimerSlack(profile.slackUs);
+    
+    std::cout << "Power profile: " << POWER_STATE_NAMES[state]
+              << " (fps " << (profile.fps >= 0 ? std::to_string(profile.fps) : std::string("max"))
+              << ", pixel size " << profile.pixelSize << ", algorithm " << profile.algorithm
+              << ", flip " << profile.flip << "%)" << std::endl;
+}
+
+void updatePowerPolicy() {
+    if (!g_powerPolicy) return;
+    double now = platformGetTime();
+    bool first = g_lastPowerPoll < 0.0;
+    if (!first && now - g_lastPowerPoll < POWER_POLL_INTERVAL) return;
+    g_lastPowerPoll = now;
+    
+    int state = platformPowerState(g_powerState);
+    if (first || state != g_powerState) applyPowerProfile(state);
+}
+
+/*
+ * CPU Governor
+ */
+// --cpu-budget holds CPU use to a share of one core. Each level of the ladder is cheaper
+// than the one before: it scales the power profile's FPS and flip rate and multiplies its
+// pixel size. A coarser pixel size costs a background relayout, so it comes last.
+struct GovernorLevel {
+    int fpsPercent;
+    int flipPercent;
+    int pixelScale;
+};
+const GovernorLevel GOVERNOR_LEVELS[] = {
+    {100, 100, 1}, {75, 100, 1}, {50, 100, 1}, {50, 50, 1}, {35, 50, 1}, {25, 50, 1},
+    {25, 25, 1}, {25, 25, 2}, {15, 25, 2}, {10, 25, 2}, {10, 25, 3}, {5, 25, 3}};
+const int GOVERNOR_LEVEL_COUNT = (int)(sizeof(GOVERNOR_LEVELS) / sizeof(GOVERNOR_LEVELS[0]));
+const double GOVERNOR_WINDOW = 2.0;       // seconds of rendering per measurement
+const double GOVERNOR_GAP = 1.5;          // seconds without a frame that count as a pause
+const double GOVERNOR_DOWN_TARGET = 0.9;  // stepping down aims this far under the budget
+const double GOVERNOR_UP_MARGIN = 0.75;   // the level above must be predicted this far under it
+const int GOVERNOR_UP_WINDOWS = 3;        // windows in a row with room before stepping up
+int g_governorLevel = 0;
+double g_governorStart = -1.0;            // wall time the current window started, -1 = none
+double g_governorMainCpu = 0.0;           // main thread CPU time when it started
+double g_governorLastFrame = 0.0;
+bool g_governorSettling = false;          // discard the window after a level change
+int g_governorRoom = 0;                   // windows in a row with room for the level above
+double g_cpuShare = 0.0;                  // last measured percent of one core
+
+// FPS of the operating point, -1 = no limit
+int operatingFps() {
+    int fps = currentPowerProfile().fps;
+    int percent = GOVERNOR_LEVELS[g_governorLevel].fpsPercent;
+    if (percent == 100 || fps == 0) return fps;
+    int base = fps > 0 ? fps : g_maxFps > 0 ? g_maxFps : 60;
+    return std::max(1, base * percent / 100);
+}
+
+int operatingFlip() {
+    return std::max(1, currentPowerProfile().flip * GOVERNOR_LEVELS[g_governorLevel].flipPercent / 100);
+}
+
+int operatingPixelSize() {
+    return currentPowerProfile().pixelSize * GOVERNOR_LEVELS[g_governorLevel].pixelScale;
+}
+
+// The main loop reads FPS and pixel size every frame; algorithm and flip rate belong to
+// the dithering threads, so they change while those are stopped
+void applyOperatingPoint() {
+    int algorithm = currentPowerProfile().algorithm;
+    int flip = operatingFlip();
+    if (algorithm == g_algorithm && flip == g_flipPercent) return;
+    stopProducer();
+    g_algorithm = algorithm;
+    g_flipPercent = flip;
+    startProducer();
+    g_redrawNeeded = true;
+}
+
+std::string operatingPointStats() {
+    int fps = operatingFps();
+    char stats[128];
+    snprintf(stats, sizeof(stats), "level %d: fps %s, flip %d%%, pixel size %d", g_governorLevel,
+             fps >= 0 ? std::to_string(fps).c_str() : "max", operatingFlip(), operatingPixelSize());
+    return stats;
+}
+
+// Dithered and uploaded pixels per second, relative to the other levels
+static double levelCost(int level) {
+    const GovernorLevel& l = GOVERNOR_LEVELS[level];
+    return l.fpsPercent * l.flipPercent / (double)(l.pixelScale * l.pixelScale);
+}
+
+static void startGovernorWindow(double now) {
+    g_governorStart = now;
+    g_governorMainCpu = platformThreadCpuTime();
+    g_ditherCpuUs = 0;
+}
+
+// Called after every presented frame with the main thread's and the dithering threads'
+// CPU time. Over budget, it drops straight to the first level predicted to fit; with room
+// to spare it climbs one level at a time, and only once the room has lasted a few windows.
+// A window that spans a pause starts over, as the idle time would hide the real cost.
+void updateGovernor(double now) {
+    if (g_cpuBudget <= 0.0f) return;
+    bool paused = now - g_governorLastFrame > GOVERNOR_GAP;
+    g_governorLastFrame = now;
+    if (g_governorStart < 0.0 || paused) {
+        startGovernorWindow(now);
+        return;
+    }
+    double wall = now - g_governorStart;
+    if (wall < GOVERNOR_WINDOW) return;
+    
+    double cpu = platformThreadCpuTime() - g_governorMainCpu + g_ditherCpuUs / 1000000.0;
+    startGovernorWindow(now);
+    if (g_governorSettling) {
+        // The window saw the switch itself, a relayout or a restarted producer
+        g_governorSettling = false;
+        return;
+    }
+    g_cpuShare = cpu / wall * 100.0;
+    
+    int level = g_governorLevel;
+    double predicted = g_cpuShare / levelCost(level);  // share per unit of cost
+    if (g_cpuShare > g_cpuBudget) {
+        g_governorRoom = 0;
+        while (level + 1 < GOVERNOR_LEVEL_COUNT &&
+               predicted * levelCost(level) > g_cpuBudget * GOVERNOR_DOWN_TARGET) {
+            level++;
+        }
+    } else if (level > 0 && predicted * levelCost(level - 1) < g_cpuBudget * GOVERNOR_UP_MARGIN) {
+        if (++g_governorRoom >= GOVERNOR_UP_WINDOWS) {
+            level--;
+            g_governorRoom = 0;
+        }
+    } else {
+        g_governorRoom = 0;
+    }
+    if (level == g_governorLevel) return;
+    
+    int previous = g_governorLevel;
+    g_governorLevel = level;
+    g_governorSettling = true;
+    char share[64];
+    snprintf(share, sizeof(share), "%.1f%% of a %.1f%% budget", g_cpuShare, g_cpuBudget);
+    std::cout << "CPU governor: " << share << ", level " << previous << " -> "
+              << operatingPointStats() << std::endl;
+}
+
+/*
+ * Windows Implementation
+ */
+#if PLATFORM_WINDOWS
+
+BOOL CALLBACK FindWorkerWEnumProc(HWND hwnd, LPARAM lParam) {
+    HWND* pTarget = reinterpret_cast<HWND*>(lParam);
+    char className[256];
+    GetClassNameA(hwnd, className, 256);
+    if (strcmp(className, "WorkerW") == 0) {
+        *pTarget = hwnd;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL CALLBACK FindShellViewEnumProc(HWND hwnd, LPARAM lParam) {
+    HWND* pTarget = reinterpret_cast<HWND*>(lParam);
+    char className[256];
+    GetClassNameA(hwnd, className, 256);
+    if (strcmp(className, "SHELLDLL_DefView") == 0) {
+        *pTarget = hwnd;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    switch (msg) {
+    case WM_DESTROY:
+        wglMakeCurrent(NULL, NULL);
+        wglDeleteContext(g_hRC);
+        ReleaseDC(hwnd, g_hDC);
+        PostQuitMessage(0);
+        g_running = false;
+        return 0;
+    case WM_PAINT:
+        ValidateRect(hwnd, nullptr);
+        g_redrawNeeded = true;
+        return 0;
+    case WM_KEYDOWN:
+        if (wParam == VK_ESCAPE) {
+            DestroyWindow(hwnd);
+        }
+        return 0;
+    }
+    return DefWindowProc(hwnd, msg, wParam, lParam);
+}
+
+void platformInit(int& screenWidth, int& screenHeight) {
+    SetProcessDPIAware();
+    
+    HDC hdc = GetDC(nullptr);
+    screenWidth = GetDeviceCaps(hdc, HORZRES);
+    screenHeight = GetDeviceCaps(hdc, VERTRES);
+    ReleaseDC(nullptr, hdc);
+    
+    g_hProgman = FindWindowA("Progman", nullptr);
+    SendMessageTimeout(g_hProgman, 0x052C, 0, 0, SMTO_NORMAL, 100, nullptr);
+    
+    EnumChildWindows(g_hProgman, FindShellViewEnumProc, (LPARAM)&g_hShellView);
+    EnumChildWindows(g_hProgman, FindWorkerWEnumProc, (LPARAM)&g_hWorkerW);
+    
+    WNDCLASSA wc = {};
+    wc.lpfnWndProc = WndProc;
+    wc.hInstance = GetModuleHandle(nullptr);
+    wc.lpszClassName = "LiveDitherBG";
+    wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
+    RegisterClassA(&wc);
+    
+    DWORD exStyle = WS_EX_LAYERED | WS_EX_NOACTIVATE | WS_EX_TOOLWINDOW;
+    
+    g_hMyWallpaper = CreateWindowExA(
+        exStyle, "LiveDitherBG", "LiveDitherBG",
+        WS_POPUP | WS_VISIBLE | WS_CLIPCHILDREN | WS_CLIPSIBLINGS,
+        0, 0, screenWidth, screenHeight,
+        nullptr, nullptr, wc.hInstance, nullptr
+    );
+    
+    if (g_hMyWallpaper) {
+        SetParent(g_hMyWallpaper, g_hProgman);
+        SetWindowLong(g_hMyWallpaper, GWL_STYLE, WS_CHILD | WS_VISIBLE | WS_CLIPCHILDREN | WS_CLIPSIBLINGS);
+        SetLayeredWindowAttributes(g_hMyWallpaper, 0, 255, LWA_ALPHA);
+        SetWindowPos(g_hMyWallpaper, g_hShellView, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
+        if (g_hWorkerW) SetWindowPos(g_hWorkerW, g_hMyWallpaper, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOACTIVATE);
+    } else {
+        std::cerr << "Failed to create window." << std::endl;
+        exit(1);
+    }
+    
+    g_hDC = GetDC(g_hMyWallpaper);
+    
+    PIXELFORMATDESCRIPTOR pfd = {};
+    pfd.nSize = sizeof(PIXELFORMATDESCRIPTOR);
+    pfd.nVersion = 1;
+    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+    pfd.iPixelType = PFD_TYPE_RGBA;
+    pfd.cColorBits = 32;
+    pfd.cDepthBits = 24;
+    pfd.iLayerType = PFD_MAIN_PLANE;
+    
+    int format = ChoosePixelFormat(g_hDC, &pfd);
+    SetPixelFormat(g_hDC, format, &pfd);
+    
+    g_hRC = wglCreateContext(g_hDC);
+    wglMakeCurrent(g_hDC, g_hRC);
+    
+    glViewport(0, 0, screenWidth, screenHeight);
+    
+    glGenTextures(1, &g_textureID);
+    glBindTexture(GL_TEXTURE_2D, g_textureID);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glEnable(GL_TEXTURE_2D);
+    
+    timeBeginPeriod(1);
+}
+
+// Upload tile rows [row0, row1) of the frame into the texture
+void platformRenderBand(int row0, int row1) {
+    glBindTexture(GL_TEXTURE_2D, g_textureID);
+    if (g_textureWidth != g_scaledWidth || g_textureHeight != g_scaledHeight) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, g_scaledWidth, g_scaledHeight, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        g_textureWidth = g_scaledWidth;
+        g_textureHeight = g_scaledHeight;
+    }
+    int y0 = row0 * TILE_SIZE;
+    int y1 = (row1 >= g_tilesY) ? g_scaledHeight : row1 * TILE_SIZE;
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, g_scaledWidth, y1 - y0,
+                    GL_RGBA, GL_UNSIGNED_BYTE, g_scaledPixels + (size_t)y0 * g_scaledWidth * 4);
+}
+
+void platformPresent() {
+    glClear(GL_COLOR_BUFFER_BIT);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, -1.0f);
+    glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, 1.0f);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, 1.0f);
+    glEnd();
+    
+    SwapBuffers(g_hDC);
+}
+
+// The loop is paced by its timer here, so a skipped frame needs nothing
+void platformSkipFrame() {
+}
+
+// Every tile is always uploaded
+void platformTilesChanged() {
+}
+
+// Leaves the list empty: the whole desktop is one monitor
+void platformQueryMonitors(std::vector<Monitor>& monitors) {
+}
+
+// Display changes aren't tracked on Windows yet
+bool platformLayoutChanged(int& screenWidth, int& screenHeight) {
+    return false;
+}
+
+bool platformImagesChanged() {
+    return false;
+}
+
+// No thermal readings here; battery state comes from GetSystemPowerStatus
+int platformPowerState(int current) {
+    SYSTEM_POWER_STATUS status;
+    if (!GetSystemPowerStatus(&status) || status.ACLineStatus != 0) return POWER_AC;
+    bool low = status.BatteryLifePercent != 255 && status.BatteryLifePercent <= g_lowBattery;
+    return low ? POWER_LOW : POWER_BATTERY;
+}
+
+void platformSetTimerSlack(int us) {
+}
+
+int platformCpuLimit() {
+    DWORD_PTR processMask, systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) return 1;
+    int cpus = 0;
+    for (; processMask; processMask &= processMask - 1) cpus++;
+    return std::max(1, cpus);
+}
+
+// No SCHED_IDLE here; the idle priority class comes closest, nice levels map onto the
+// priorities below normal
+void platformLowerThreadPriority() {
+    int priority = g_niceLevel <= 0 ? THREAD_PRIORITY_IDLE
+                 : g_niceLevel >= 10 ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL;
+    SetThreadPriority(GetCurrentThread(), priority);
+}
+
+// The scheduler steers threads between core classes itself; only a --cores list pins
+int platformCoreClasses(std::vector<int>& classOf, bool byFrequency) {
+    classOf.clear();
+    return 1;
+}
+
+bool platformPinThreads(const std::vector<int>& cpus) {
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < (int)(sizeof(DWORD_PTR) * 8)) mask |= (DWORD_PTR)1 << cpu;
+    }
+    return mask != 0 && SetProcessAffinityMask(GetCurrentProcess(), mask);
+}
+
+int platformCurrentCpu() {
+    return (int)GetCurrentProcessorNumber();
+}
+
+void platformResize(int screenWidth, int screenHeight) {
+    SetWindowPos(g_hMyWallpaper, nullptr, 0, 0, screenWidth, screenHeight, SWP_NOZORDER | SWP_NOACTIVATE);
+    glViewport(0, 0, screenWidth, screenHeight);
+}
+
+void platformImageReady() {
+}
+
+std::string platformProfileStats() {
+    return "";
+}
+
+bool platformFrameReady() {
+    return true;
+}
+
+// 0 pauses rendering, >0 caps the frame rate, -1 leaves max_fps alone
+int platformFpsCap() {
+    if (g_idleTimeout <= 0) return -1;
+    LASTINPUTINFO input = {sizeof(LASTINPUTINFO), 0};
+    if (!GetLastInputInfo(&input)) return -1;
+    DWORD idleMs = GetTickCount() - input.dwTime;
+    return idleMs >= (DWORD)g_idleTimeout * 1000 ? g_idleFps : -1;
+}
+
+void platformWaitEvents(int timeoutMs) {
+    MsgWaitForMultipleObjects(0, nullptr, FALSE, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs, QS_ALLINPUT);
+}
+
+bool platformSetupPacing() {
+    return false;
+}
+
+bool platformPaceFps(int fps) {
+    return false;
+}
+
+void platformPollEvents() {
+    MSG msg;
+    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+        if (msg.message == WM_QUIT) g_running = false;
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+}
+
+void platformCleanup() {
+    timeEndPeriod(1);
+}
+
+double platformGetTime() {
+    static LARGE_INTEGER freq = {};
+    static LARGE_INTEGER start = {};
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&start);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)(now.QuadPart - start.QuadPart) / freq.QuadPart;
+}
+
+double platformThreadCpuTime() {
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) return 0.0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 10000000.0;  // 100 ns units
+}
+
+// Waits work in whole milliseconds (timeBeginPeriod(1) is in effect) and end early for
+// window messages; --spin-us busy-waits the remainder for sub-millisecond accuracy
+void platformSleepUntil(double deadline) {
+    double wake = deadline - g_spinUs / 1000000.0;
+    double now = platformGetTime();
+    if (wake > now) {
+        platformWaitEvents((int)ceil((wake - now) * 1000.0));
+        if (platformGetTime() < wake) return;
+    }
+    if (g_spinUs > 0) {
+        while (platformGetTime() < deadline) {}
+    }
 }
 
 #endif // PLATFORM_WINDOWS
 
 /*
- * X11 Implementation
+ * X11 Implementation
+ */
+#if PLATFORM_X11
+
+// ZPixmap frames are written with native stores, so they are in the host's byte order
+static int hostByteOrder() {
+    const uint16_t probe = 1;
+    return *(const uint8_t*)&probe ? LSBFirst : MSBFirst;
+}
+
+// Locate xfdesktop window by title 'xfceliveDesktop' (requires patched xfdesktop)
+
+static Window getXfceDesktopWindow(Display* display, Window root) {
+    Window parent, *children;
+    unsigned int nchildren;
+    Window result = None;
+    
+    if (XQueryTree(display, root, &parent, &parent, &children, &nchildren)) {
+        for (unsigned int i = 0; i < nchildren; i++) {
+            char* name = nullptr;
+            if (XFetchName(display, children[i], &name) > 0) {
+                if (name && std::string(name) == "xfceliveDesktop") {
+                    result = children[i];
+                    XFree(name);
+                    break;
+                }
+                XFree(name);
+            }
+        }
+        if (children) XFree(children);
+    }
+    
+    // Fallback to property check if name lookup fails
+    if (result == None) {
+        Atom atom = g_atoms[ATOM_XFCE_DESKTOP_WINDOW];
+        Atom actual_type;
+        int actual_format;
+        unsigned long nitems, bytes_after;
+        unsigned char* prop = nullptr;
+        
+        if (XGetWindowProperty(display, root, atom, 0, 1, False, XA_WINDOW,
+                               &actual_type, &actual_format, &nitems, &bytes_after, &prop) == Success) {
+            if (actual_type == XA_WINDOW && nitems == 1 && prop) {
+                result = *((Window*)prop);
+            }
+            if (prop) XFree(prop);
+        }
+    }
+    
+    return result;
+}
+
+static void internAtoms() {
+#if HAVE_XCB
+    if (g_xcb) {
+        // Send every request first, then collect the replies: one round trip
+        xcb_intern_atom_cookie_t cookies[ATOM_COUNT];
+        for (int i = 0; i < ATOM_COUNT; i++) {
+            cookies[i] = xcb_intern_atom(g_xcb, 0, (uint16_t)strlen(ATOM_NAMES[i]), ATOM_NAMES[i]);
+        }
+        // The desktop window lookup needs the root's children; let that reply ride along
+        g_rootTreeCookie = xcb_query_tree(g_xcb, g_root);
+        
+        for (int i = 0; i < ATOM_COUNT; i++) {
+            xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(g_xcb, cookies[i], nullptr);
+            g_atoms[i] = reply ? reply->atom : None;
+            free(reply);
+        }
+        return;
+    }
+#endif
+    XInternAtoms(g_display, (char**)ATOM_NAMES, ATOM_COUNT, False, g_atoms);
+}
+
+#if HAVE_XCB
+// Same lookup as getXfceDesktopWindow, but all names are requested before any reply
+// is read, so hundreds of root children cost one round trip instead of hundreds
+static Window getXfceDesktopWindowXcb() {
+    const char* wanted = "xfceliveDesktop";
+    int wantedLen = (int)strlen(wanted);
+    Window result = None;
+    
+    xcb_get_property_cookie_t fallbackCookie = xcb_get_property(
+        g_xcb, 0, g_root, g_atoms[ATOM_XFCE_DESKTOP_WINDOW], XCB_ATOM_WINDOW, 0, 1);
+    
+    xcb_query_tree_reply_t* tree = xcb_query_tree_reply(g_xcb, g_rootTreeCookie, nullptr);
+    if (tree) {
+        int count = xcb_query_tree_children_length(tree);
+        xcb_window_t* children = xcb_query_tree_children(tree);
+        
+        std::vector<xcb_get_property_cookie_t> cookies(count);
+        for (int i = 0; i < count; i++) {
+            cookies[i] = xcb_get_property(g_xcb, 0, children[i], XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 0, 16);
+        }
+        for (int i = 0; i < count; i++) {
+            if (result != None) {
+                xcb_discard_reply(g_xcb, cookies[i].sequence);
+                continue;
+            }
+            xcb_get_property_reply_t* reply = xcb_get_property_reply(g_xcb, cookies[i], nullptr);
+            if (reply && reply->format == 8 && xcb_get_property_value_length(reply) == wantedLen &&
+                memcmp(xcb_get_property_value(reply), wanted, wantedLen) == 0) {
+                result = children[i];
+            }
+            free(reply);
+        }
+        free(tree);
+    }
+    
+    // Fallback to property check if name lookup fails
+    xcb_get_property_reply_t* fallback = xcb_get_property_reply(g_xcb, fallbackCookie, nullptr);
+    if (result == None && fallback && fallback->type == XCB_ATOM_WINDOW && fallback->value_len == 1) {
+        result = *(xcb_window_t*)xcb_get_property_value(fallback);
+    }
+    free(fallback);
+    
+    return result;
+}
+
+static void setupXcb(int depth) {
+    g_xcb = XGetXCBConnection(g_display);
+    const xcb_setup_t* setup = xcb_get_setup(g_xcb);
+    g_xcbMaxRequest = (size_t)xcb_get_maximum_request_length(g_xcb) * 4;
+    
+    // xcb_put_image sends bytes verbatim, so only use it where our layout is the server's.
+    // Bitmaps are packed LSB first, ZPixmap frames in host byte order.
+    bool lsbImages = setup->image_byte_order == XCB_IMAGE_ORDER_LSB_FIRST;
+    bool hostImages = setup->image_byte_order ==
+                      (hostByteOrder() == LSBFirst ? XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST);
+    g_xcbBitmapOk = lsbImages && setup->bitmap_format_bit_order == XCB_IMAGE_ORDER_LSB_FIRST &&
+                    setup->bitmap_format_scanline_pad == 32;
+    
+    xcb_format_t* formats = xcb_setup_pixmap_formats(setup);
+    int formatCount = xcb_setup_pixmap_formats_length(setup);
+    for (int i = 0; i < formatCount; i++) {
+        if (formats[i].depth == depth) {
+            int bpp = formats[i].bits_per_pixel;
+            g_xcbZPixmapOk = hostImages && (bpp == 16 || bpp == 24 || bpp == 32) && formats[i].scanline_pad == 32;
+        }
+    }
+    
+#if HAVE_XCB_SHM
+    xcb_shm_query_version_reply_t* shm = xcb_shm_query_version_reply(g_xcb, xcb_shm_query_version(g_xcb), nullptr);
+    g_shmAvailable = shm != nullptr;
+    free(shm);
+#endif
+    
+    std::cout << "XCB: max request " << g_xcbMaxRequest << " bytes, direct bitmap "
+              << (g_xcbBitmapOk ? "yes" : "no") << ", direct zpixmap " << (g_xcbZPixmapOk ? "yes" : "no") << std::endl;
+}
+#endif
+
+#if HAVE_XCB_SHM
+// Shared memory segment the server reads frames from; fails for remote servers
+static char* allocShm(ShmBuffer& buf, size_t size) {
+    buf.id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (buf.id < 0) return nullptr;
+    
+    buf.addr = (char*)shmat(buf.id, nullptr, 0);
+    if (buf.addr == (char*)-1) {
+        shmctl(buf.id, IPC_RMID, nullptr);
+        buf = {0, -1, nullptr};
+        return nullptr;
+    }
+    
+    buf.seg = xcb_generate_id(g_xcb);
+    xcb_generic_error_t* error = xcb_request_check(g_xcb, xcb_shm_attach_checked(g_xcb, buf.seg, buf.id, 0));
+    // Mark for removal now; the segment lives on until both sides detach
+    shmctl(buf.id, IPC_RMID, nullptr);
+    if (error) {
+        free(error);
+        shmdt(buf.addr);
+        buf = {0, -1, nullptr};
+        return nullptr;
+    }
+    return buf.addr;
+}
+#endif
+
+static char* allocFrameBuffer(size_t size, bool bitmap) {
+    char* data = nullptr;
+#if HAVE_XCB_SHM
+    if (g_shmAvailable) data = allocShm(bitmap ? g_bitmapShm : g_imageShm, size);
+#else
+    (void)bitmap;
+#endif
+    if (!data) data = new char[size];
+    memset(data, 0, size);
+    return data;
+}
+
+static void freeFrameBuffer(char* data, bool bitmap) {
+#if HAVE_XCB_SHM
+    ShmBuffer& shm = bitmap ? g_bitmapShm : g_imageShm;
+    if (data && data == shm.addr) {
+        xcb_shm_detach(g_xcb, shm.seg);
+        shmdt(shm.addr);
+        shm = {0, -1, nullptr};
+        return;
+    }
+#else
+    (void)bitmap;
+#endif
+    delete[] data;
+}
+
+// Signal handler for graceful termination
+static void signalHandler(int sig) {
+    (void)sig;
+    g_running = false;
+}
+
+// Xfconf helper functions for background configuration
+static void setXfconfProp(std::string suffix, int val) {
+    std::string v = std::to_string(val);
+    std::string cmd = 
+        "PREFIX=$(xfconf-query -c xfce4-desktop -l | grep last-image | head -n1 | sed 's/last-image//'); "
+        "if [ ! -z \"$PREFIX\" ]; then "
+        "  PROP=\"${PREFIX}" + suffix + "\"; "
+        "  xfconf-query -c xfce4-desktop -p \"$PROP\" -s " + v + " 2>/dev/null || "
+        "  xfconf-query -c xfce4-desktop -p \"$PROP\" -n -t int -s " + v + "; "
+        "fi";
+    system(cmd.c_str());
+}
+
+static void restoreXfconfSettings() {
+    static bool restored = false;
+    if (restored) return;
+    restored = true;
+    std::cout << "Restoring xfdesktop settings..." << std::endl;
+    setXfconfProp("color-style", 0); // Solid
+    setXfconfProp("image-style", 5); // Zoomed
+    std::cout << "Restored." << std::endl;
+}
+
+static Pixmap readRootPmap(Atom atom) {
+    Atom actualType;
+    int actualFormat;
+    unsigned long nitems, bytesAfter;
+    unsigned char* prop = nullptr;
+    Pixmap result = None;
+    
+    if (XGetWindowProperty(g_display, g_root, atom, 0, 1, False, XA_PIXMAP,
+                           &actualType, &actualFormat, &nitems, &bytesAfter, &prop) == Success) {
+        if (actualType == XA_PIXMAP && nitems == 1 && prop) result = *((Pixmap*)prop);
+        if (prop) XFree(prop);
+    }
+    return result;
+}
+
+static void setupRootPixmap(int width, int height, int depth) {
+    if (g_backBuffer == None) {
+        std::cerr << "Warning: --root-pixmap needs double buffering, disabled" << std::endl;
+        return;
+    }
+    
+    // Remember whose pixmap we replace only the first time; later calls follow a resize
+    Pixmap previous = g_rootPixmap;
+    if (!previous) {
+        for (int i = 0; i < 2; i++) g_savedRootPmaps[i] = readRootPmap(g_atoms[ATOM_XROOTPMAP_ID + i]);
+    }
+    
+    g_rootPixmap = XCreatePixmap(g_display, g_root, width, height, depth);
+    XSetForeground(g_display, g_gc, g_blackPixel);
+    XFillRectangle(g_display, g_rootPixmap, g_gc, 0, 0, width, height);
+    XSetForeground(g_display, g_gc, g_orangePixel);
+    
+    for (int i = 0; i < 2; i++) {
+        XChangeProperty(g_display, g_root, g_atoms[ATOM_XROOTPMAP_ID + i], XA_PIXMAP, 32, PropModeReplace,
+                        (unsigned char*)&g_rootPixmap, 1);
+    }
+    XSetWindowBackgroundPixmap(g_display, g_root, g_rootPixmap);
+    if (previous) XFreePixmap(g_display, previous);
+    g_rootDamage = {0, 0, width, height};
+    
+    std::cout << "Publishing root pixmap at " << g_rootPixmapRate << " Hz" << std::endl;
+}
+
+// Copy what changed since the last refresh into the root pixmap, server-side
+static void refreshRootPixmap() {
+    if (!g_rootPixmap || g_rootDamage.x1 <= g_rootDamage.x0) return;
+    
+    double now = platformGetTime();
+    if (now - g_lastRootRefresh < 1.0 / g_rootPixmapRate) return;
+    g_lastRootRefresh = now;
+    
+    int x = g_rootDamage.x0, y = g_rootDamage.y0;
+    int width = g_rootDamage.x1 - x, height = g_rootDamage.y1 - y;
+    g_rootDamage = {INT_MAX, INT_MAX, 0, 0};
+    
+    XCopyArea(g_display, g_backBuffer, g_rootPixmap, g_gc, x, y, width, height, x, y);
+    XClearArea(g_display, g_root, x, y, width, height, False);
+    
+    // Rewriting the same ID sends PropertyNotify, which is what these clients watch
+    for (int i = 0; i < 2; i++) {
+        XChangeProperty(g_display, g_root, g_atoms[ATOM_XROOTPMAP_ID + i], XA_PIXMAP, 32, PropModeReplace,
+                        (unsigned char*)&g_rootPixmap, 1);
+    }
+}
+
+// Hand the root background back to whoever owned it before us
+static void releaseRootPixmap() {
+    if (!g_rootPixmap) return;
+    
+    for (int i = 0; i < 2; i++) {
+        if (readRootPmap(g_atoms[ATOM_XROOTPMAP_ID + i]) != g_rootPixmap) continue;
+        if (g_savedRootPmaps[i]) {
+            XChangeProperty(g_display, g_root, g_atoms[ATOM_XROOTPMAP_ID + i], XA_PIXMAP, 32, PropModeReplace,
+                            (unsigned char*)&g_savedRootPmaps[i], 1);
+        } else {
+            XDeleteProperty(g_display, g_root, g_atoms[ATOM_XROOTPMAP_ID + i]);
+        }
+    }
+    XSetWindowBackgroundPixmap(g_display, g_root, g_savedRootPmaps[0] ? g_savedRootPmaps[0] : None);
+    XClearWindow(g_display, g_root);
+    XFreePixmap(g_display, g_rootPixmap);
+    g_rootPixmap = None;
+}
+
+// Buffers sized to the screen: the back buffer, root pixmap and frame images. Client-side
+// frame buffers are kept when the new frame still fits.
+static void createFrameResources(int screenWidth, int screenHeight) {
+    Visual* visual = DefaultVisual(g_display, g_screen);
+    int depth = DefaultDepth(g_display, g_screen);
+    
+    g_target = g_window;
+    if (g_doubleBuffer) {
+        g_backBuffer = XCreatePixmap(g_display, g_window, screenWidth, screenHeight, depth);
+        XSetForeground(g_display, g_gc, g_blackPixel);
+        XFillRectangle(g_display, g_backBuffer, g_gc, 0, 0, screenWidth, screenHeight);
+        XSetForeground(g_display, g_gc, g_orangePixel);
+        g_target = g_backBuffer;
+        
+        // Exposed areas are copied back from the buffer, so the server must not clear them
+        XSetWindowBackgroundPixmap(g_display, g_window, None);
+    }
+    
+    if (g_rootPixmapRate > 0.0f) setupRootPixmap(screenWidth, screenHeight, depth);
+    
+    if (g_backend >= 1) {
+        int bytesPerLine = ((screenWidth + 31) / 32) * 4;
+        size_t size = (size_t)bytesPerLine * screenHeight;
+        if (size > g_bitmapCapacity) {
+            freeFrameBuffer(g_bitmapData, true);
+            g_bitmapData = allocFrameBuffer(size, true);
+            g_bitmapCapacity = size;
+        }
+        
+        g_bitmapImage = XCreateImage(g_display, visual, 1, XYBitmap, 0,
+                                     g_bitmapData, screenWidth, screenHeight, 32, bytesPerLine);
+        if (!g_bitmapImage) {
+            std::cerr << "Failed to create bitmap XImage" << std::endl;
+            exit(1);
+        }
+        // Fix the bit layout so packing doesn't depend on the server; Xlib swaps if needed
+        g_bitmapImage->byte_order = LSBFirst;
+        g_bitmapImage->bitmap_bit_order = LSBFirst;
+        XInitImage(g_bitmapImage);
+    } else {
+        // Rows in the server's own pixmap format for this depth: 16 bpp on most VNC
+        // sessions, packed 24 bpp on some, 32 bpp for depth 24 and depth 30
+        int scanlinePad = 32;
+        int formatCount = 0;
+        XPixmapFormatValues* formats = XListPixmapFormats(g_display, &formatCount);
+        for (int i = 0; i < formatCount; i++) {
+            if (formats[i].depth == depth) scanlinePad = formats[i].scanline_pad;
+        }
+        if (formats) XFree(formats);
+        
+        g_ximage = XCreateImage(g_display, visual, depth, ZPixmap, 0,
+                                nullptr, screenWidth, screenHeight, scanlinePad, 0);
+        if (!g_ximage) {
+            std::cerr << "Failed to create XImage" << std::endl;
+            exit(1);
+        }
+        // Converters store whole pixels natively; Xlib swaps if the server differs
+        g_ximage->byte_order = hostByteOrder();
+        XInitImage(g_ximage);
+        
+        size_t size = (size_t)g_ximage->bytes_per_line * screenHeight;
+        if (size > g_imageCapacity) {
+            freeFrameBuffer(g_imageData, false);
+            g_imageData = allocFrameBuffer(size, false);
+            g_imageCapacity = size;
+        }
+        g_ximage->data = g_imageData;
+    }
+}
+
+// Drop everything tied to the old screen size; the frame buffers themselves stay
+static void releaseFrameResources() {
+    if (g_ximage) {
+        g_ximage->data = nullptr;  // Prevent XDestroyImage from freeing our buffer
+        XDestroyImage(g_ximage);
+        g_ximage = nullptr;
+    }
+    if (g_bitmapImage) {
+        g_bitmapImage->data = nullptr;
+        XDestroyImage(g_bitmapImage);
+        g_bitmapImage = nullptr;
+    }
+    if (g_overlayGC) { XFreeGC(g_display, g_overlayGC); g_overlayGC = nullptr; }
+    if (g_maskGC) { XFreeGC(g_display, g_maskGC); g_maskGC = nullptr; }
+    if (g_stipple) { XFreePixmap(g_display, g_stipple); g_stipple = None; }
+    if (g_ambiguousMask) { XFreePixmap(g_display, g_ambiguousMask); g_ambiguousMask = None; }
+    if (g_staticPixmap) { XFreePixmap(g_display, g_staticPixmap); g_staticPixmap = None; }
+    if (g_backBuffer) { XFreePixmap(g_display, g_backBuffer); g_backBuffer = None; }
+}
+
+void platformInit(int& screenWidth, int& screenHeight) {
+    // Set up signal handlers for graceful termination
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+    
+    // Configure xfdesktop for transparency
+    std::cout << "Configuring xfdesktop for transparency..." << std::endl;
+    setXfconfProp("color-style", 3); // Transparent
+    setXfconfProp("image-style", 0); // None
+    
+    // Register exit handler to restore settings
+    atexit(restoreXfconfSettings);
+    
+    // Every Xlib call stays on the main thread; the dithering threads only touch pixel
+    // buffers, so the display needs no XInitThreads() locking on each request
+    g_display = XOpenDisplay(nullptr);
+    if (!g_display) {
+        std::cerr << "Failed to open X display" << std::endl;
+        exit(1);
+    }
+    
+    g_screen = DefaultScreen(g_display);
+    g_root = DefaultRootWindow(g_display);
+    
+#if HAVE_XCB
+    if (g_useXcb) setupXcb(DefaultDepth(g_display, g_screen));
+#endif
+    
+    screenWidth = DisplayWidth(g_display, g_screen);
+    screenHeight = DisplayHeight(g_display, g_screen);
+    
+    std::cout << "X11 Display opened: " << screenWidth << "x" << screenHeight << std::endl;
+    
+    Visual* visual = DefaultVisual(g_display, g_screen);
+    int depth = DefaultDepth(g_display, g_screen);
+    
+    std::cout << "Using depth: " << depth << std::endl;
+    
+    Colormap colormap = XCreateColormap(g_display, g_root, visual, AllocNone);
+    
+    XSetWindowAttributes attrs;
+    attrs.colormap = colormap;
+    attrs.background_pixel = BlackPixel(g_display, g_screen);
+    attrs.event_mask = ExposureMask | StructureNotifyMask | PropertyChangeMask | VisibilityChangeMask;
+    
+    g_window = XCreateWindow(
+        g_display, g_root,
+        0, 0, screenWidth, screenHeight,
+        0,                          // border width
+        depth,                      // depth
+        InputOutput,                // class
+        visual,                     // visual
+        CWColormap | CWBackPixel | CWEventMask,
+        &attrs
+    );
+    
+    if (!g_window) {
+        std::cerr << "Failed to create X11 window" << std::endl;
+        exit(1);
+    }
+    
+    // Set _NET_WM_WINDOW_TYPE to DESKTOP
+    internAtoms();
+    XChangeProperty(g_display, g_window, g_atoms[ATOM_NET_WM_WINDOW_TYPE], XA_ATOM, 32, PropModeReplace,
+                    (unsigned char*)&g_atoms[ATOM_NET_WM_WINDOW_TYPE_DESKTOP], 1);
+    
+
+    
+    XStoreName(g_display, g_window, "Live Dither Background");
+    
+    // Use XShape extension to make window input-transparent (click-through)
+#ifdef ShapeInput
+    XRectangle rect = {0, 0, 1, 1};
+    Region rgn = XCreateRegion();
+    XUnionRectWithRegion(&rect, rgn, rgn);
+    XShapeCombineRegion(g_display, g_window, ShapeInput, 0, 0, rgn, ShapeSet);
+    XDestroyRegion(rgn);
+    std::cout << "XShape input transparency enabled" << std::endl;
+#endif
+    
+    XMapWindow(g_display, g_window);
+    
+#if HAVE_XCB
+    Window xfdesktopWin = g_xcb ? getXfceDesktopWindowXcb() : getXfceDesktopWindow(g_display, g_root);
+#else
+    Window xfdesktopWin = getXfceDesktopWindow(g_display, g_root);
+#endif
+    
+    // Force proper desktop behavior via _NET_WM_STATE (the four state atoms are adjacent)
+    XChangeProperty(g_display, g_window, g_atoms[ATOM_NET_WM_STATE], XA_ATOM, 32, PropModeReplace,
+                    (unsigned char*)&g_atoms[ATOM_NET_WM_STATE_BELOW], 4);
+
+    g_xfdesktopWin = xfdesktopWin;
+    
+    // Configure window stacking order
+    if (xfdesktopWin != None) {
+        std::cout << "Found xfdesktop window: " << xfdesktopWin << std::endl;
+        
+        XLowerWindow(g_display, xfdesktopWin);
+        XLowerWindow(g_display, g_window);
+        
+        // Activate show desktop mode to ensure proper layering
+        std::cout << "Activating show desktop mode..." << std::endl;
+        int ret = system("wmctrl -k on");
+        if (ret != 0) std::cerr << "Warning: wmctrl call failed" << std::endl;
+        
+    } else {
+        std::cout << "Warning: xfdesktop window not found. Icons may be hidden." << std::endl;
+        XLowerWindow(g_display, g_window);
+    }
+    
+    g_gc = XCreateGC(g_display, g_window, 0, nullptr);
+    
+    // Resolve the two frame colors for the window's visual
+    XColor color = {};
+    color.flags = DoRed | DoGreen | DoBlue;
+    color.red = color.green = color.blue = 0;
+    g_blackPixel = XAllocColor(g_display, colormap, &color) ? color.pixel : BlackPixel(g_display, g_screen);
+    color.red = ORANGE_RGBA[0] * 257;
+    color.green = ORANGE_RGBA[1] * 257;
+    color.blue = ORANGE_RGBA[2] * 257;
+    g_orangePixel = XAllocColor(g_display, colormap, &color) ? color.pixel : WhitePixel(g_display, g_screen);
+    
+    // XYBitmap images draw set bits in the foreground and clear bits in the background
+    XSetForeground(g_display, g_gc, g_orangePixel);
+    XSetBackground(g_display, g_gc, g_blackPixel);
+    XSetGraphicsExposures(g_display, g_gc, False);
+    
+    createFrameResources(screenWidth, screenHeight);
+    
+#if HAVE_XPRESENT
+    if (g_backBuffer) {
+        int presentEvent, presentError;
+        if (XPresentQueryExtension(g_display, &g_presentOpcode, &presentEvent, &presentError)) {
+            g_presentAvailable = true;
+            g_presentRegion = XFixesCreateRegion(g_display, nullptr, 0);
+            g_presentEventId = XPresentSelectInput(g_display, g_window, PresentCompleteNotifyMask);
+        }
+        std::cout << "Double buffering: " << (g_presentAvailable ? "Present" : "XCopyArea") << std::endl;
+    }
+#else
+    if (g_backBuffer) std::cout << "Double buffering: XCopyArea" << std::endl;
+#endif
+    if (g_backend >= 1) {
+        std::cout << (g_backend >= 2 ? "Using static pixmap with stipple overlay" : "Using 1-bpp bitmap upload") << std::endl;
+    } else {
+        std::cout << "Using ZPixmap upload (" << g_ximage->bits_per_pixel << " bpp)" << std::endl;
+    }
+    
+    // Follow resolution changes and monitor hotplug
+    int randrError;
+    if (XRRQueryExtension(g_display, &g_randrEventBase, &randrError)) {
+        XRRSelectInput(g_display, g_root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+    } else {
+        g_randrEventBase = -1;
+    }
+    
+#if HAVE_XCB_SHM
+    if (g_bitmapShm.addr || g_imageShm.addr) {
+        // The server reads the frame buffer in place; never write it while a frame is queued
+        g_maxInFlight = 1;
+        std::cout << "Using MIT-SHM frame buffer" << std::endl;
+    }
+#endif
+    
+    XFlush(g_display);
+    
+    std::cout << "X11 desktop window initialized with XShape click-through" << std::endl;
+}
+
+#if HAVE_XCB
+// Send image rows with xcb_put_image, split to fit the maximum request size
+static void xcbPutImage(Drawable drawable, GC gc, XImage* image, int x, int y, int width, int height) {
+    static std::vector<uint8_t> scratch;
+    bool bitmap = image->format == XYBitmap;
+    uint8_t format = bitmap ? XCB_IMAGE_FORMAT_XY_BITMAP : XCB_IMAGE_FORMAT_Z_PIXMAP;
+    uint8_t depth = bitmap ? 1 : (uint8_t)image->depth;
+    int bitsPerPixel = bitmap ? 1 : image->bits_per_pixel;
+    
+    size_t rowBytes = (((size_t)width * bitsPerPixel + 31) / 32) * 4;
+    const char* src = image->data + (size_t)y * image->bytes_per_line + (size_t)x * bitsPerPixel / 8;
+    int rowsPerRequest = (int)((g_xcbMaxRequest - 64) / rowBytes);
+    if (rowsPerRequest < 1) rowsPerRequest = 1;
+    bool contiguous = rowBytes == (size_t)image->bytes_per_line;
+    
+    for (int row = 0; row < height; row += rowsPerRequest) {
+        int rows = (height - row < rowsPerRequest) ? height - row : rowsPerRequest;
+        const char* rowsSrc = src + (size_t)row * image->bytes_per_line;
+        const uint8_t* data = (const uint8_t*)rowsSrc;
+        
+        if (!contiguous) {
+            // Sub-rectangle: gather its rows into one padded block
+            scratch.resize(rowBytes * rows);
+            for (int r = 0; r < rows; r++) {
+                memcpy(&scratch[r * rowBytes], rowsSrc + (size_t)r * image->bytes_per_line, rowBytes);
+            }
+            data = scratch.data();
+        }
+        xcb_put_image(g_xcb, format, drawable, XGContextFromGC(gc), width, rows, x, y + row,
+                      0, depth, (uint32_t)(rowBytes * rows), data);
+    }
+}
+#endif
+
+// Upload [x, x+width) x [y, y+height) of image to the same spot on drawable
+static void putImage(Drawable drawable, GC gc, XImage* image, int x, int y, int width, int height) {
+#if HAVE_XCB
+    bool bitmap = image->format == XYBitmap;
+    // Bitmap rows must start on a 32-bit scanline unit so left_pad can stay 0
+    bool direct = bitmap ? (g_xcbBitmapOk && (x & 31) == 0) : g_xcbZPixmapOk;
+    if (g_xcb && direct) {
+        // Xlib holds back GC changes until its own next request; push them out first
+        XFlushGC(g_display, gc);
+        
+#if HAVE_XCB_SHM
+        ShmBuffer& shm = bitmap ? g_bitmapShm : g_imageShm;
+        if (shm.addr && shm.addr == image->data) {
+            // The server reads straight from our buffer; no pixel data on the socket
+            xcb_shm_put_image(g_xcb, drawable, XGContextFromGC(gc), image->width, image->height,
+                              x, y, width, height, x, y, bitmap ? 1 : image->depth,
+                              bitmap ? XCB_IMAGE_FORMAT_XY_BITMAP : XCB_IMAGE_FORMAT_Z_PIXMAP,
+                              0, shm.seg, 0);
+            return;
+        }
+#endif
+        xcbPutImage(drawable, gc, image, x, y, width, height);
+        return;
+    }
+#endif
+    XPutImage(g_display, drawable, gc, image, x, y, x, y, width, height);
+}
+
+// Grow the frame's damage box, which presentFrame() copies to the window
+static void growBox(DamageBox& box, int x, int y, int width, int height) {
+    if (x < box.x0) box.x0 = x;
+    if (y < box.y0) box.y0 = y;
+    if (x + width > box.x1) box.x1 = x + width;
+    if (y + height > box.y1) box.y1 = y + height;
+}
+
+static void addDamage(int x, int y, int width, int height) {
+    growBox(g_damage, x, y, width, height);
+    if (g_rootPixmap) growBox(g_rootDamage, x, y, width, height);
+}
+
+static void addDamage(const XRectangle& rect) {
+    addDamage(rect.x, rect.y, rect.width, rect.height);
+}
+
+// Pack output pixels [x0, x1) x [y0, y1) into g_bitmapData as LSBFirst bits.
+// x0 must be a multiple of 8; isSet(pixIdx) decides each scaled pixel's bit.
+template <typename IsSet>
+static void packBitmap(int x0, int y0, int x1, int y1, IsSet isSet) {
+    int bytesPerLine = g_bitmapImage->bytes_per_line;
+    uint8_t* bits = (uint8_t*)g_bitmapData;
+    int byte0 = x0 >> 3;
+    int byteCount = ((x1 + 7) >> 3) - byte0;
+    int lastSrcY = -1;
+    
+    for (int y = y0; y < y1; y++) {
+        int srcY = y / g_pixelSize;
+        if (srcY >= g_scaledHeight) srcY = g_scaledHeight - 1;
+        
+        uint8_t* dst = bits + y * bytesPerLine + byte0;
+        if (srcY == lastSrcY) {
+            // Rows inside one pixel block are identical
+            memcpy(dst, dst - bytesPerLine, byteCount);
+            continue;
+        }
+        
+        memset(dst, 0, byteCount);
+        int rowBase = srcY * g_scaledWidth;
+        for (int x = x0; x < x1; x++) {
+            int srcX = x / g_pixelSize;
+            if (srcX >= g_scaledWidth) srcX = g_scaledWidth - 1;
+            if (isSet(rowBase + srcX)) dst[(x >> 3) - byte0] |= (uint8_t)(1 << (x & 7));
+        }
+        lastSrcY = srcY;
+    }
+}
+
+// Frame pixels are either BLACK_RGBA or ORANGE_RGBA; red tells them apart
+static inline bool frameIsOrange(int pixIdx) {
+    return g_scaledPixels[pixIdx * 4] != 0;
+}
+
+// Upload rectangles are tile runs ordered by row. Returns the ones in tile rows [row0, row1).
+static std::pair<const XRectangle*, const XRectangle*> bandRects(const std::vector<XRectangle>& rects,
+                                                                   int row0, int row1) {
+    int span = TILE_SIZE * g_pixelSize;
+    auto below = [](const XRectangle& rect, int y) { return rect.y < y; };
+    const XRectangle* first = rects.data();
+    const XRectangle* last = rects.data() + rects.size();
+    const XRectangle* begin = std::lower_bound(first, last, row0 * span, below);
+    const XRectangle* end = (row1 >= g_tilesY) ? last : std::lower_bound(begin, last, row1 * span, below);
+    return {begin, end};
+}
+
+static void renderBitmap(int row0, int row1) {
+    auto band = bandRects(g_visibleRects, row0, row1);
+    for (const XRectangle* r = band.first; r != band.second; r++) {
+        const XRectangle& rect = *r;
+        packBitmap(rect.x, rect.y, rect.x + rect.width, rect.y + rect.height, frameIsOrange);
+        putImage(g_target, g_gc, g_bitmapImage, rect.x, rect.y, rect.width, rect.height);
+        addDamage(rect);
+    }
+}
+
+// Output rectangle of a tile; edge tiles absorb the pixels left over by g_pixelSize
+static XRectangle tileRect(int tx, int ty) {
+    int span = TILE_SIZE * g_pixelSize;
+    int x0 = tx * span;
+    int y0 = ty * span;
+    int x1 = (tx == g_tilesX - 1) ? g_imgWidth : x0 + span;
+    int y1 = (ty == g_tilesY - 1) ? g_imgHeight : y0 + span;
+    XRectangle rect = {(short)x0, (short)y0, (unsigned short)(x1 - x0), (unsigned short)(y1 - y0)};
+    return rect;
+}
+
+// Merge the tiles accepted by wanted(tile) into horizontal runs
+template <typename Wanted>
+static void collectTileRuns(std::vector<XRectangle>& runs, Wanted wanted) {
+    runs.clear();
+    for (int ty = 0; ty < g_tilesY; ty++) {
+        for (int tx = 0; tx < g_tilesX; tx++) {
+            int tile = ty * g_tilesX + tx;
+            if (!wanted(tile)) continue;
+            XRectangle rect = tileRect(tx, ty);
+            if (tx > 0 && wanted(tile - 1)) {
+                runs.back().width += rect.width;
+            } else {
+                runs.push_back(rect);
+            }
+        }
+    }
+}
+
+// Recompute the upload rectangles after the image or tile visibility changed
+static void rebuildTileRects() {
+    collectTileRuns(g_visibleRects, [](int t) { return g_renderVisible[t] != 0; });
+    collectTileRuns(g_overlayRects, [](int t) {
+        return g_renderVisible[t] && g_tileStart[t + 1] > g_tileStart[t];
+    });
+    
+    g_visibleArea = 0;
+    for (const XRectangle& rect : g_visibleRects) g_visibleArea += (long long)rect.width * rect.height;
+}
+
+// Upload the static layer once and collect the screen area the overlay must redraw
+// An SHM put only names the segment; the server reads it whenever it gets to the request.
+// Per-frame uploads are fenced by markFrame, but one-time uploads that refill the buffer
+// right away must wait for the server to be done with it.
+static void finishShmUpload() {
+#if HAVE_XCB_SHM
+    if (g_bitmapShm.addr) XSync(g_display, False);
+#endif
+}
+
+static void prepareOverlay() {
+    int depth = DefaultDepth(g_display, g_screen);
+    
+    // Static layer: fixed orange pixels, everything else black. It is uploaded once;
+    // the server copies it into the back buffer, or repaints it as the window
+    // background when drawing straight to the window.
+    packBitmap(0, 0, g_imgWidth, g_imgHeight, [](int i) { return g_pixelStates[i] == PIXEL_ORANGE; });
+    g_staticPixmap = XCreatePixmap(g_display, g_window, g_imgWidth, g_imgHeight, depth);
+    putImage(g_staticPixmap, g_gc, g_bitmapImage, 0, 0, g_imgWidth, g_imgHeight);
+    finishShmUpload();  // the mask is packed into the same buffer next
+    if (g_target == g_window) {
+        XSetWindowBackgroundPixmap(g_display, g_window, g_staticPixmap);
+        XClearWindow(g_display, g_window);
+    } else {
+        XCopyArea(g_display, g_staticPixmap, g_target, g_gc, 0, 0, g_imgWidth, g_imgHeight, 0, 0);
+        addDamage(0, 0, g_imgWidth, g_imgHeight);
+    }
+    
+    // Depth-1 pixmaps: the ambiguous mask (clip) and the per-frame stipple
+    g_ambiguousMask = XCreatePixmap(g_display, g_window, g_imgWidth, g_imgHeight, 1);
+    g_stipple = XCreatePixmap(g_display, g_window, g_imgWidth, g_imgHeight, 1);
+    XGCValues maskValues;
+    maskValues.foreground = 1;
+    maskValues.background = 0;
+    g_maskGC = XCreateGC(g_display, g_ambiguousMask, GCForeground | GCBackground, &maskValues);
+    
+    packBitmap(0, 0, g_imgWidth, g_imgHeight, [](int i) { return g_pixelStates[i] == PIXEL_AMBIGUOUS; });
+    putImage(g_ambiguousMask, g_maskGC, g_bitmapImage, 0, 0, g_imgWidth, g_imgHeight);
+    finishShmUpload();  // and the first frame's stipple after it
+    
+    // Opaque stipple paints orange for set bits and black for clear ones, and the clip
+    // mask keeps it off static pixels, so no copy of the static layer is needed per frame
+    XGCValues overlayValues;
+    overlayValues.foreground = g_orangePixel;
+    overlayValues.background = g_blackPixel;
+    overlayValues.fill_style = FillOpaqueStippled;
+    overlayValues.stipple = g_stipple;
+    overlayValues.ts_x_origin = 0;
+    overlayValues.ts_y_origin = 0;
+    overlayValues.clip_mask = g_ambiguousMask;
+    overlayValues.clip_x_origin = 0;
+    overlayValues.clip_y_origin = 0;
+    g_overlayGC = XCreateGC(g_display, g_window,
+                            GCForeground | GCBackground | GCFillStyle | GCStipple |
+                            GCTileStipXOrigin | GCTileStipYOrigin |
+                            GCClipMask | GCClipXOrigin | GCClipYOrigin,
+                            &overlayValues);
+    
+    rebuildTileRects();
+    long long overlayArea = 0;
+    for (const XRectangle& rect : g_overlayRects) overlayArea += (long long)rect.width * rect.height;
+    g_presented.assign(g_ambiguousIndices.size(), 0);
+    g_presentedValid = false;
+    
+    XFlush(g_display);
+    
+    std::cout << "Overlay: " << g_overlayRects.size() << " rects covering "
+              << (100.0 * overlayArea / ((long long)g_imgWidth * g_imgHeight)) << "% of the screen" << std::endl;
+}
+
+// Send a band's ambiguous tiles as stipple bits and record what is now on screen
+static void renderOverlayImage(std::pair<const XRectangle*, const XRectangle*> band, int row0, int row1) {
+    for (const XRectangle* rect = band.first; rect != band.second; rect++) {
+        packBitmap(rect->x, rect->y, rect->x + rect->width, rect->y + rect->height, frameIsOrange);
+        putImage(g_stipple, g_maskGC, g_bitmapImage, rect->x, rect->y, rect->width, rect->height);
+        addDamage(*rect);
+    }
+    
+    XFillRectangles(g_display, g_target, g_overlayGC, (XRectangle*)band.first, (int)(band.second - band.first));
+    
+    for (int tile = row0 * g_tilesX; tile < row1 * g_tilesX; tile++) {
+        if (!g_renderVisible[tile]) continue;
+        for (int i = g_tileStart[tile]; i < g_tileStart[tile + 1]; i++) {
+            g_presented[i] = frameIsOrange(g_ambiguousIndices[i]);
+        }
+    }
+}
+
+// Collect changed blocks of tile rows [row0, row1) as horizontal runs grouped by color.
+// Gives up and returns false once the rectangles would cost more than maxBytes.
+static bool collectChangedRuns(size_t maxBytes, int row0, int row1) {
+    g_orangeRuns.clear();
+    g_blackRuns.clear();
+    size_t maxRuns = maxBytes / sizeof(XRectangle);
+    
+    int lastPixIdx = -2;
+    bool lastOrange = false;
+    std::vector<XRectangle>* lastRuns = nullptr;
+    
+    for (int tile = row0 * g_tilesX; tile < row1 * g_tilesX; tile++) {
+        if (!g_renderVisible[tile]) continue;
+        for (int i = g_tileStart[tile]; i < g_tileStart[tile + 1]; i++) {
+            int pixIdx = g_ambiguousIndices[i];
+            bool isOrange = frameIsOrange(pixIdx);
+            if (isOrange == (bool)g_presented[i]) continue;
+            g_presented[i] = isOrange;
+            
+            int x = pixIdx % g_scaledWidth;
+            int y = pixIdx / g_scaledWidth;
+            
+            // Extend the previous run when this block continues it on the same row
+            if (pixIdx == lastPixIdx + 1 && x != 0 && isOrange == lastOrange) {
+                XRectangle& run = lastRuns->back();
+                run.width = (unsigned short)(((x == g_scaledWidth - 1) ? g_imgWidth : (x + 1) * g_pixelSize) - run.x);
+            } else {
+                if (g_orangeRuns.size() + g_blackRuns.size() >= maxRuns) return false;
+                
+                int x0 = x * g_pixelSize;
+                int y0 = y * g_pixelSize;
+                int x1 = (x == g_scaledWidth - 1) ? g_imgWidth : x0 + g_pixelSize;
+                int y1 = (y == g_scaledHeight - 1) ? g_imgHeight : y0 + g_pixelSize;
+                lastRuns = isOrange ? &g_orangeRuns : &g_blackRuns;
+                lastRuns->push_back({(short)x0, (short)y0, (unsigned short)(x1 - x0), (unsigned short)(y1 - y0)});
+            }
+            lastPixIdx = pixIdx;
+            lastOrange = isOrange;
+        }
+    }
+    return true;
+}
+
+static void renderOverlay(int row0, int row1) {
+    auto band = bandRects(g_overlayRects, row0, row1);
+    if (band.first == band.second) return;
+    
+    // Rectangles win when few blocks changed, which is typical for large pixel sizes.
+    // They compete with the bytes a stipple upload of the band costs (rows padded to 32 bits).
+    size_t budget = 0;
+    for (const XRectangle* rect = band.first; rect != band.second; rect++) {
+        budget += (size_t)((rect->width + 31) / 32) * 4 * rect->height;
+    }
+    if (g_backend == 3) budget = SIZE_MAX;
+    if (g_presentedValid && collectChangedRuns(budget, row0, row1)) {
+        if (!g_orangeRuns.empty()) {
+            XSetForeground(g_display, g_gc, g_orangePixel);
+            XFillRectangles(g_display, g_target, g_gc, g_orangeRuns.data(), (int)g_orangeRuns.size());
+        }
+        if (!g_blackRuns.empty()) {
+            XSetForeground(g_display, g_gc, g_blackPixel);
+            XFillRectangles(g_display, g_target, g_gc, g_blackRuns.data(), (int)g_blackRuns.size());
+            XSetForeground(g_display, g_gc, g_orangePixel);
+        }
+        for (const XRectangle& run : g_orangeRuns) addDamage(run);
+        for (const XRectangle& run : g_blackRuns) addDamage(run);
+        g_frameUsedRects = true;
+    } else {
+        renderOverlayImage(band, row0, row1);
+    }
+}
+
+
+// A frame only holds the two allocated colors, so converting to any TrueColor format
+// is a store of one of two precomputed pixel values. XAllocColor already encoded them
+// for the visual: RGB565/555 at 16 bpp, packed 24 bpp, x8r8g8b8 or 2-10-10-10 at 32 bpp.
+struct Pixel24 { uint8_t bytes[3]; };
+
+static Pixel24 toPixel24(unsigned long pixel) {
+    Pixel24 packed;
+    for (int i = 0; i < 3; i++) {
+        int shift = (g_ximage->byte_order == LSBFirst) ? 8 * i : 8 * (2 - i);
+        packed.bytes[i] = (uint8_t)(pixel >> shift);
+    }
+    return packed;
+}
+
+template <typename Pixel>
+static void convertZPixmapRect(const XRectangle& rect, Pixel black, Pixel orange) {
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+        int srcY = std::min(y / g_pixelSize, g_scaledHeight - 1);
+        const uint8_t* src = &g_scaledPixels[(size_t)srcY * g_scaledWidth * 4];
+        Pixel* dst = (Pixel*)(g_imageData + (size_t)y * g_ximage->bytes_per_line);
+        for (int x = rect.x; x < rect.x + rect.width; x++) {
+            int srcX = std::min(x / g_pixelSize, g_scaledWidth - 1);
+            dst[x] = src[srcX * 4] ? orange : black;  // red is 255 for orange, 0 for black
+        }
+    }
+}
+
+static void renderZPixmapRect(const XRectangle& rect) {
+    switch (g_ximage->bits_per_pixel) {
+    case 32:
+        convertZPixmapRect<uint32_t>(rect, (uint32_t)g_blackPixel, (uint32_t)g_orangePixel);
+        break;
+    case 24:
+        convertZPixmapRect<Pixel24>(rect, toPixel24(g_blackPixel), toPixel24(g_orangePixel));
+        break;
+    case 16:
+        convertZPixmapRect<uint16_t>(rect, (uint16_t)g_blackPixel, (uint16_t)g_orangePixel);
+        break;
+    default:
+        // Anything else (8-bit PseudoColor) goes through Xlib's generic path
+        for (int y = rect.y; y < rect.y + rect.height; y++) {
+            int srcY = std::min(y / g_pixelSize, g_scaledHeight - 1);
+            for (int x = rect.x; x < rect.x + rect.width; x++) {
+                int srcX = std::min(x / g_pixelSize, g_scaledWidth - 1);
+                bool isOrange = g_scaledPixels[(srcY * g_scaledWidth + srcX) * 4] != 0;
+                XPutPixel(g_ximage, x, y, isOrange ? g_orangePixel : g_blackPixel);
+            }
+        }
+        break;
+    }
+    
+    putImage(g_target, g_gc, g_ximage, rect.x, rect.y, rect.width, rect.height);
+    addDamage(rect);
+}
+
+static void renderZPixmap(int row0, int row1) {
+    auto band = bandRects(g_visibleRects, row0, row1);
+    for (const XRectangle* rect = band.first; rect != band.second; rect++) renderZPixmapRect(*rect);
+}
+
+// Queue a round-trip marker behind the frame's requests
+static void markFrame() {
+    static uint32_t serial = 0;
+    serial++;
+    XChangeProperty(g_display, g_window, g_atoms[ATOM_LIVE_DITHER_FRAME], XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char*)&serial, 1);
+    g_framesInFlight++;
+    if (g_framesInFlight > g_peakInFlight) g_peakInFlight = g_framesInFlight;
+    if (g_framesInFlight >= g_maxInFlight) g_throttledFrames++;
+    XFlush(g_display);
+}
+
+// A frame with nothing to show still takes its vblank slot. Under Present pacing nothing
+// else holds the loop back, so without the MSC notify it would spin.
+static void waitForVblankSlot() {
+#if HAVE_XPRESENT
+    if (g_presentAvailable && g_target == g_backBuffer) {
+        XPresentNotifyMSC(g_display, g_window, ++g_presentSerial, 0, std::max(1, g_vblankDivisor), 0);
+        g_presentPending = true;
+    }
+#endif
+    XFlush(g_display);
+}
+
+// Show the damaged part of the back buffer with one copy, synced to vblank via Present
+static void presentFrame() {
+    if (g_damage.x1 <= g_damage.x0) {
+        waitForVblankSlot();
+        return;
+    }
+    if (g_target == g_window) {
+        g_damage = {INT_MAX, INT_MAX, 0, 0};
+        markFrame();
+        return;
+    }
+    
+    XRectangle area = {(short)g_damage.x0, (short)g_damage.y0,
+                       (unsigned short)(g_damage.x1 - g_damage.x0),
+                       (unsigned short)(g_damage.y1 - g_damage.y0)};
+    g_damage = {INT_MAX, INT_MAX, 0, 0};
+    
+#if HAVE_XPRESENT
+    if (g_presentAvailable) {
+        // Copy mode keeps the back buffer ours: it is idle again once the copy ran
+        XFixesSetRegion(g_display, g_presentRegion, &area, 1);
+        XPresentPixmap(g_display, g_window, g_backBuffer, ++g_presentSerial,
+                       None, g_presentRegion, 0, 0, None, None, None,
+                       PresentOptionCopy, 0, g_vblankDivisor, 0, nullptr, 0);
+        g_presentPending = true;
+        markFrame();
+        return;
+    }
+#endif
+    
+    XCopyArea(g_display, g_backBuffer, g_window, g_gc, area.x, area.y, area.width, area.height, area.x, area.y);
+    markFrame();
+}
+
+static ClientWindow* findClient(Window window) {
+    for (ClientWindow& client : g_clients) {
+        if (client.id == window) return &client;
+    }
+    return nullptr;
+}
+
+static bool clientWindow(XID id) {
+    if (id == None) return false;
+    if (id == g_activeWindow || findClient((Window)id)) return true;
+    return std::find(g_goneWindows.begin(), g_goneWindows.end(), id) != g_goneWindows.end();
+}
+
+// Requests about a window we stop tracking may still be on their way
+static void forgetWindow(Window window) {
+    if (window == None) return;
+    if (g_goneWindows.size() >= GONE_WINDOWS) g_goneWindows.erase(g_goneWindows.begin());
+    g_goneWindows.push_back(window);
+}
+
+// Clients come and go between us reading the stacking list or active window and
+// querying them; a BadWindow about one of them is expected. Anything else, errors about
+// our own window and pixmaps included, goes to Xlib's handler.
+static int clientErrorHandler(Display* display, XErrorEvent* error) {
+    if ((error->error_code == BadWindow || error->error_code == BadDrawable) && clientWindow(error->resourceid)) {
+        return 0;
+    }
+    return g_defaultErrorHandler(display, error);
+}
+
+// Occlusion needs geometry changes of every client, the focus policy state changes of the active one
+static long clientEventMask(Window client) {
+    long mask = g_occlusion ? StructureNotifyMask : NoEventMask;
+    if (client == g_activeWindow && g_focusTracking) mask |= PropertyChangeMask;
+    return mask;
+}
+
+// Re-read _NET_CLIENT_LIST_STACKING and listen for geometry changes on new clients
+static void updateClientList() {
+    Atom actualType;
+    int actualFormat;
+    unsigned long nitems, bytesAfter;
+    unsigned char* prop = nullptr;
+    std::vector<Window> clients;
+    
+    if (XGetWindowProperty(g_display, g_root, g_atoms[ATOM_NET_CLIENT_LIST_STACKING], 0, 4096, False,
+                           XA_WINDOW, &actualType, &actualFormat, &nitems, &bytesAfter, &prop) == Success) {
+        if (actualType == XA_WINDOW && prop) {
+            Window* windows = (Window*)prop;
+            clients.assign(windows, windows + nitems);
+        }
+        if (prop) XFree(prop);
+    }
+    
+    // Known clients keep their cached geometry; new ones are queried on the next update
+    std::vector<ClientWindow> stacked;
+    stacked.reserve(clients.size());
+    for (Window client : clients) {
+        ClientWindow entry = {client, {0, 0, 0, 0}, false, false, false, false};
+        bool known = false;
+        for (const ClientWindow& old : g_clients) {
+            if (old.id == client) { entry = old; known = true; break; }
+        }
+        if (!known) XSelectInput(g_display, client, clientEventMask(client));
+        stacked.push_back(entry);
+    }
+    g_clients.swap(stacked);
+    for (const ClientWindow& old : stacked) {
+        if (!findClient(old.id)) forgetWindow(old.id);
+    }
+    g_occlusionDirty = true;
+}
+
+// Structure events keep the cache current without a round trip per client and update
+static void updateClientGeometry(const XEvent& event) {
+    ClientWindow* client = findClient(event.xany.window);
+    if (!client) return;
+    if (event.type == ConfigureNotify) {
+        client->rect.width = (unsigned short)event.xconfigure.width;
+        client->rect.height = (unsigned short)event.xconfigure.height;
+        // Window managers send synthetic events in root coordinates (ICCCM 4.1.5);
+        // real ones are relative to the parent, which is a frame under a reparenting WM
+        if (event.xconfigure.send_event) {
+            client->rect.x = (short)event.xconfigure.x;
+            client->rect.y = (short)event.xconfigure.y;
+        }
+        client->positioned = event.xconfigure.send_event;
+    } else {
+        client->viewable = event.type == MapNotify;
+    }
+    g_occlusionDirty = true;
+}
+
+// Query only the clients the cache can't answer: new ones and those with a stale position
+static void queryClientGeometry() {
+    std::vector<ClientWindow*> pending;
+    for (ClientWindow& client : g_clients) {
+        if (client.id == g_window || client.id == g_xfdesktopWin) continue;
+        if (!client.queried || !client.positioned) pending.push_back(&client);
+    }
+    if (pending.empty()) return;
+    
+#if HAVE_XCB
+    if (g_xcb) {
+        // Send every request first, then collect the replies: one round trip for all of them
+        size_t count = pending.size();
+        std::vector<xcb_get_window_attributes_cookie_t> attrCookies(count);
+        std::vector<xcb_get_geometry_cookie_t> geometryCookies(count);
+        std::vector<xcb_translate_coordinates_cookie_t> originCookies(count);
+        for (size_t i = 0; i < count; i++) {
+            if (!pending[i]->queried) {
+                attrCookies[i] = xcb_get_window_attributes(g_xcb, (xcb_window_t)pending[i]->id);
+                geometryCookies[i] = xcb_get_geometry(g_xcb, (xcb_drawable_t)pending[i]->id);
+            }
+            originCookies[i] = xcb_translate_coordinates(g_xcb, (xcb_window_t)pending[i]->id, (xcb_window_t)g_root, 0, 0);
+        }
+        for (size_t i = 0; i < count; i++) {
+            ClientWindow& client = *pending[i];
+            if (!client.queried) {
+                xcb_get_window_attributes_reply_t* attrs = xcb_get_window_attributes_reply(g_xcb, attrCookies[i], nullptr);
+                xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(g_xcb, geometryCookies[i], nullptr);
+                // A window destroyed meanwhile stays hidden until the client list drops it
+                client.queried = true;
+                client.viewable = attrs && geometry && attrs->map_state == XCB_MAP_STATE_VIEWABLE;
+                client.opaque = geometry && geometry->depth != 32;
+                if (geometry) {
+                    client.rect.width = geometry->width;
+                    client.rect.height = geometry->height;
+                }
+                free(attrs);
+                free(geometry);
+            }
+            xcb_translate_coordinates_reply_t* origin = xcb_translate_coordinates_reply(g_xcb, originCookies[i], nullptr);
+            client.positioned = true;
+            if (origin) {
+                client.rect.x = origin->dst_x;
+                client.rect.y = origin->dst_y;
+            }
+            free(origin);
+        }
+        return;
+    }
+#endif
+    
+    for (ClientWindow* client : pending) {
+        if (!client->queried) {
+            XWindowAttributes attrs;
+            client->queried = true;
+            client->viewable = false;
+            if (!XGetWindowAttributes(g_display, client->id, &attrs)) continue;
+            client->viewable = attrs.map_state == IsViewable;
+            client->opaque = attrs.depth != 32;
+            client->rect.width = (unsigned short)attrs.width;
+            client->rect.height = (unsigned short)attrs.height;
+        }
+        int rootX, rootY;
+        Window child;
+        client->positioned = true;
+        if (!XTranslateCoordinates(g_display, client->id, g_root, 0, 0, &rootX, &rootY, &child)) continue;
+        client->rect.x = (short)rootX;
+        client->rect.y = (short)rootY;
+    }
+}
+
+// Work out which tiles no opaque client window covers
+static void updateOcclusion() {
+    g_occlusionDirty = false;
+    g_lastOcclusionUpdate = platformGetTime();
+    
+    // Start from the monitors, so the dead zones between them stay hidden
+    Region visible = XCreateRegion();
+    for (const Monitor& m : g_monitors) {
+        XRectangle area = {(short)m.x, (short)m.y, (unsigned short)m.width, (unsigned short)m.height};
+        XUnionRectWithRegion(&area, visible, visible);
+    }
+    
+    queryClientGeometry();
+    Region covered = XCreateRegion();
+    for (ClientWindow& client : g_clients) {
+        if (client.id == g_window || client.id == g_xfdesktopWin) continue;
+        // Unmapped, minimized and other-workspace windows hide nothing; neither do
+        // ARGB windows, which may be translucent
+        if (!client.viewable || !client.opaque) continue;
+        XUnionRectWithRegion(&client.rect, covered, covered);
+    }
+    XSubtractRegion(visible, covered, visible);
+    XDestroyRegion(covered);
+    
+    // The upload rectangles follow once a frame dithered with the new visibility is presented
+    for (int ty = 0; ty < g_tilesY; ty++) {
+        for (int tx = 0; tx < g_tilesX; tx++) {
+            XRectangle rect = tileRect(tx, ty);
+            uint8_t isVisible = XRectInRegion(visible, rect.x, rect.y, rect.width, rect.height) != RectangleOut;
+            uint8_t& tile = g_tileVisible[ty * g_tilesX + tx];
+            // Uncovered tiles were never drawn into the back buffer
+            if (isVisible && !tile) g_redrawNeeded = true;
+            tile = isVisible;
+        }
+    }
+    XDestroyRegion(visible);
+}
+
+/*
+ * Focus Policy
  */
-#if PLATFORM_X11
+static bool focusClassMatches(const char* name) {
+    if (!name || !*name) return false;
+    size_t length = strlen(name);
+    for (const char* entry = g_focusClasses; *entry; ) {
+        const char* end = strchr(entry, ',');
+        size_t entryLength = end ? (size_t)(end - entry) : strlen(entry);
+        if (entryLength == length && strncasecmp(entry, name, length) == 0) return true;
+        if (!end) break;
+        entry = end + 1;
+    }
+    return false;
+}
 
-// Locate xfdesktop window by title 'xfceliveDesktop' (requires patched xfdesktop)
+// Re-read the active window's _NET_WM_STATE and WM_CLASS
+static void updateActiveState() {
+    bool fullscreen = false;
+    bool matched = false;
+    
+    if (g_activeWindow) {
+        Atom actualType;
+        int actualFormat;
+        unsigned long nitems, bytesAfter;
+        unsigned char* prop = nullptr;
+        if (XGetWindowProperty(g_display, g_activeWindow, g_atoms[ATOM_NET_WM_STATE], 0, 64, False, XA_ATOM,
+                               &actualType, &actualFormat, &nitems, &bytesAfter, &prop) == Success) {
+            if (actualType == XA_ATOM && prop) {
+                Atom* states = (Atom*)prop;
+                for (unsigned long i = 0; i < nitems; i++) {
+                    if (states[i] == g_atoms[ATOM_NET_WM_STATE_FULLSCREEN]) fullscreen = true;
+                }
+            }
+            if (prop) XFree(prop);
+        }
+        
+        XClassHint hint = {nullptr, nullptr};
+        if (*g_focusClasses && XGetClassHint(g_display, g_activeWindow, &hint)) {
+            matched = focusClassMatches(hint.res_name) || focusClassMatches(hint.res_class);
+            if (hint.res_name) XFree(hint.res_name);
+            if (hint.res_class) XFree(hint.res_class);
+        }
+    }
+    
+    if (fullscreen != g_activeFullscreen || matched != g_activeMatched) {
+        g_activeFullscreen = fullscreen;
+        g_activeMatched = matched;
+        if (fullscreen && g_fullscreenPause) {
+            std::cout << "Focus policy: paused (fullscreen window focused)" << std::endl;
+        } else if (matched) {
+            std::cout << "Focus policy: capped at " << g_focusFps << " FPS" << std::endl;
+        } else {
+            std::cout << "Focus policy: full rate" << std::endl;
+        }
+    }
+}
 
-static Window getXfceDesktopWindow(Display* display, Window root) {
-    Window parent, *children;
-    unsigned int nchildren;
-    Window result = None;
+// Follow _NET_ACTIVE_WINDOW, moving our PropertyChangeMask to the new window
+static void updateActiveWindow() {
+    Window active = None;
+    Atom actualType;
+    int actualFormat;
+    unsigned long nitems, bytesAfter;
+    unsigned char* prop = nullptr;
+    if (XGetWindowProperty(g_display, g_root, g_atoms[ATOM_NET_ACTIVE_WINDOW], 0, 1, False, XA_WINDOW,
+                           &actualType, &actualFormat, &nitems, &bytesAfter, &prop) == Success) {
+        if (actualType == XA_WINDOW && nitems > 0 && prop) active = *(Window*)prop;
+        if (prop) XFree(prop);
+    }
     
-    if (XQueryTree(display, root, &parent, &parent, &children, &nchildren)) {
-        for (unsigned int i = 0; i < nchildren; i++) {
-            char* name = nullptr;
-            if (XFetchName(display, children[i], &name) > 0) {
-                if (name && std::string(name) == "xfceliveDesktop") {
-                    result = children[i];
-                    XFree(name);
-                    break;
+    if (active != g_activeWindow) {
+        Window previous = g_activeWindow;
+        g_activeWindow = active;
+        if (previous) XSelectInput(g_display, previous, clientEventMask(previous));
+        if (active) XSelectInput(g_display, active, clientEventMask(active));
+        forgetWindow(previous);
+    }
+    updateActiveState();
+}
+
+/*
+ * Idle Throttling
+ */
+const double DPMS_POLL_INTERVAL = 2.0;  // seconds; DPMS sends no events
+
+// Alarm on the server's IDLETIME counter (milliseconds since the last input)
+static XSyncAlarm createIdleAlarm(XSyncCounter counter, int thresholdMs, XSyncTestType test) {
+    XSyncAlarmAttributes attrs;
+    attrs.trigger.counter = counter;
+    attrs.trigger.value_type = XSyncAbsolute;
+    XSyncIntToValue(&attrs.trigger.wait_value, thresholdMs);
+    attrs.trigger.test_type = test;
+    XSyncIntToValue(&attrs.delta, 0);  // transitions keep firing with a zero delta
+    attrs.events = True;
+    return XSyncCreateAlarm(g_display, XSyncCACounter | XSyncCAValueType | XSyncCAValue |
+                            XSyncCATestType | XSyncCADelta | XSyncCAEvents, &attrs);
+}
+
+static void setupIdle() {
+    if (g_idleTimeout <= 0) return;
+    
+    XSyncCounter idleCounter = None;
+    int errorBase, major, minor;
+    if (XSyncQueryExtension(g_display, &g_syncEventBase, &errorBase) &&
+        XSyncInitialize(g_display, &major, &minor)) {
+        int count = 0;
+        XSyncSystemCounter* counters = XSyncListSystemCounters(g_display, &count);
+        for (int i = 0; i < count; i++) {
+            if (strcmp(counters[i].name, "IDLETIME") == 0) idleCounter = counters[i].counter;
+        }
+        if (counters) XSyncFreeSystemCounterList(counters);
+    }
+    
+    if (idleCounter) {
+        // One alarm for crossing the timeout, one for input pulling idle time back under it,
+        // so the loop sleeps between transitions instead of polling
+        int thresholdMs = g_idleTimeout * 1000;
+        g_idleAlarm = createIdleAlarm(idleCounter, thresholdMs, XSyncPositiveTransition);
+        g_activeAlarm = createIdleAlarm(idleCounter, thresholdMs, XSyncNegativeTransition);
+        
+        // Transitions only fire on crossings; catch a session that is already idle
+        XSyncValue value, threshold;
+        XSyncIntToValue(&threshold, thresholdMs);
+        if (XSyncQueryCounter(g_display, idleCounter, &value)) {
+            g_userIdle = XSyncValueGreaterOrEqual(value, threshold);
+        }
+        std::cout << "Idle throttling: " << g_idleFps << " FPS after " << g_idleTimeout << " s without input" << std::endl;
+    } else {
+        std::cout << "Idle throttling unavailable: no IDLETIME counter" << std::endl;
+    }
+    
+    int dpmsEvent, dpmsError;
+    g_dpmsAvailable = DPMSQueryExtension(g_display, &dpmsEvent, &dpmsError) && DPMSCapable(g_display);
+    
+#if HAVE_XSS
+    int saverError;
+    if (XScreenSaverQueryExtension(g_display, &g_saverEventBase, &saverError)) {
+        XScreenSaverSelectInput(g_display, g_root, ScreenSaverNotifyMask);
+        XScreenSaverInfo* info = XScreenSaverAllocInfo();
+        if (info && XScreenSaverQueryInfo(g_display, g_root, info)) g_saverActive = info->state == ScreenSaverOn;
+        if (info) XFree(info);
+    } else {
+        g_saverEventBase = -1;
+    }
+#endif
+}
+
+// Only asked while idle: the display can't power down without the user going idle first
+static void pollDisplayPower() {
+    if (!g_dpmsAvailable || !g_userIdle) return;
+    double now = platformGetTime();
+    if (now - g_lastIdlePoll < DPMS_POLL_INTERVAL) return;
+    g_lastIdlePoll = now;
+    
+    CARD16 level;
+    BOOL enabled;
+    if (DPMSInfo(g_display, &level, &enabled)) g_displayOff = enabled && level != DPMSModeOn;
+}
+
+/*
+ * Event Loop
+ */
+// The process sleeps in epoll_wait until an X event arrives, the frame deadline timer
+// fires or an image file is replaced, so events are handled as soon as they come in
+static struct timespec toTimespec(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = std::min((long)((seconds - ts.tv_sec) * 1000000000.0), 999999999L);
+    return ts;
+}
+
+static void watchImage(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+    std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+    
+    // Watch the directory: wallpaper tools usually write a new file and rename it over the old one
+    int wd = inotify_add_watch(g_inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        std::cerr << "Not watching " << path << " for changes" << std::endl;
+        return;
+    }
+    g_imageWatches.push_back({wd, name});
+}
+
+static void setupEventLoop() {
+    g_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epollFd < 0) {
+        std::cerr << "epoll unavailable, falling back to poll()" << std::endl;
+        return;
+    }
+    auto add = [](int fd) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(g_epollFd, EPOLL_CTL_ADD, fd, &event);
+    };
+    add(ConnectionNumber(g_display));
+    
+    g_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_timerFd >= 0) add(g_timerFd);
+    
+    g_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_inotifyFd >= 0) {
+        add(g_inotifyFd);
+        watchImage(g_imagePath);
+        for (const MonitorConfig& config : g_monitorConfigs) {
+            if (!config.image.empty()) watchImage(config.image);
+        }
+    }
+}
+
+static void readImageChanges() {
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(g_inotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            for (const ImageWatch& watch : g_imageWatches) {
+                if (event->len && watch.wd == event->wd && watch.name == event->name) {
+                    g_imagesDirty = true;
+                    g_imageChangeTime = platformGetTime();
                 }
-                XFree(name);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void waitForWakeup(int timeoutMs) {
+    if (g_epollFd < 0) {
+        struct pollfd pfd = {ConnectionNumber(g_display), POLLIN, 0};
+        poll(&pfd, 1, timeoutMs);
+        return;
+    }
+    
+    struct epoll_event events[4];
+    int count = epoll_wait(g_epollFd, events, 4, timeoutMs);
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.fd == g_timerFd) {
+            uint64_t expirations;
+            if (read(g_timerFd, &expirations, sizeof(expirations)) < 0) continue;
+        } else if (events[i].data.fd == g_inotifyFd) {
+            readImageChanges();
+        }
+    }
+}
+
+/*
+ * Power Policy
+ */
+static bool readSysfs(const std::string& path, char* value, int size) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+    bool ok = fgets(value, size, file) != nullptr;
+    fclose(file);
+    if (ok) value[strcspn(value, "\n")] = '\0';
+    return ok;
+}
+
+template <typename Visit>
+static void forEachEntry(const std::string& dir, const char* prefix, Visit visit) {
+    DIR* listing = opendir(dir.c_str());
+    if (!listing) return;
+    size_t prefixLength = strlen(prefix);
+    while (struct dirent* entry = readdir(listing)) {
+        if (entry->d_name[0] == '.' || strncmp(entry->d_name, prefix, prefixLength) != 0) continue;
+        visit(dir + "/" + entry->d_name);
+    }
+    closedir(listing);
+}
+
+// Reads <sysfs-root>/class/power_supply and /class/thermal. current is the state in
+// effect, so leaving the hot profile waits until the hottest zone has cooled a little.
+int platformPowerState(int current) {
+    std::string root = g_sysfsRoot;
+    bool onBattery = false;
+    int capacity = 100;
+    forEachEntry(root + "/class/power_supply", "", [&](const std::string& supply) {
+        char value[64];
+        if (!readSysfs(supply + "/type", value, sizeof(value)) || strcmp(value, "Battery") != 0) return;
+        // Mice and keyboards report their batteries here too, with scope Device
+        if (readSysfs(supply + "/scope", value, sizeof(value)) && strcmp(value, "Device") == 0) return;
+        if (!readSysfs(supply + "/status", value, sizeof(value)) || strcmp(value, "Discharging") != 0) return;
+        onBattery = true;
+        if (readSysfs(supply + "/capacity", value, sizeof(value))) capacity = std::min(capacity, atoi(value));
+    });
+    
+    int hottest = INT_MIN;
+    forEachEntry(root + "/class/thermal", "thermal_zone", [&](const std::string& zone) {
+        char value[64];
+        if (readSysfs(zone + "/temp", value, sizeof(value))) hottest = std::max(hottest, atoi(value) / 1000);
+    });
+    
+    int hotLimit = (current == POWER_HOT) ? g_hotTemp - HOT_HYSTERESIS : g_hotTemp;
+    if (hottest >= hotLimit) return POWER_HOT;
+    if (onBattery) return capacity <= g_lowBattery ? POWER_LOW : POWER_BATTERY;
+    return POWER_AC;
+}
+
+// Timer slack is per thread; only the main loop sleeps on timers
+void platformSetTimerSlack(int us) {
+    // 0 restores the default slack, so an explicit 0 becomes 1 ns
+    unsigned long slack = us < 0 ? 0 : std::max(1UL, (unsigned long)us * 1000);
+    prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+}
+
+/*
+ * Background Scheduling
+ */
+// Where the cgroup2 hierarchy is mounted, from /proc/self/mountinfo. cgroupfs is a mount of
+// its own, not part of sysfs. group becomes relative to the mount's root, which isn't /
+// when only a subtree is mounted (some containers).
+static std::string cgroupMount(std::string& group) {
+    // Spaces and backslashes in paths come as octal escapes: \040
+    auto unescape = [](const char* path) {
+        std::string out;
+        for (const char* c = path; *c; c++) {
+            if (c[0] == '\\' && c[1] >= '0' && c[1] <= '3' && c[2] >= '0' && c[2] <= '7' && c[3] >= '0' && c[3] <= '7') {
+                out += (char)((c[1] - '0') * 64 + (c[2] - '0') * 8 + (c[3] - '0'));
+                c += 3;
+            } else {
+                out += *c;
             }
         }
-        if (children) XFree(children);
+        return out;
+    };
+    
+    char line[1024];
+    std::string mount;
+    FILE* file = fopen("/proc/self/mountinfo", "r");
+    if (!file) return mount;
+    while (mount.empty() && fgets(line, sizeof(line), file)) {
+        // ID PARENT MAJOR:MINOR ROOT MOUNT-POINT OPTIONS [TAGS...] - TYPE SOURCE SUPER-OPTIONS
+        const char* separator = strstr(line, " - ");
+        if (!separator || strncmp(separator + 3, "cgroup2 ", 8) != 0) continue;
+        char root[512], point[512];
+        if (sscanf(line, "%*s %*s %*s %511s %511s", root, point) != 2) continue;
+        std::string rootPath = unescape(root);
+        if (rootPath != "/") {
+            if (group.compare(0, rootPath.size(), rootPath) != 0 ||
+                (group.size() > rootPath.size() && group[rootPath.size()] != '/')) continue;
+            group.erase(0, rootPath.size());
+        }
+        mount = unescape(point);
     }
+    fclose(file);
+    return mount;
+}
+
+// The affinity mask, capped by the cpu.max quota of our cgroup v2 group and each of its
+// parents, so a container or systemd slice limited to one CPU doesn't get a thread per monitor
+int platformCpuLimit() {
+    int cpus = std::max(1, (int)std::thread::hardware_concurrency());
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) cpus = CPU_COUNT(&set);
     
-    // Fallback to property check if name lookup fails
-    if (result == None) {
-        Atom atom = XInternAtom(display, "XFCE_DESKTOP_WINDOW", False);
-        Atom actual_type;
-        int actual_format;
-        unsigned long nitems, bytes_after;
-        unsigned char* prop = nullptr;
-        
-        if (XGetWindowProperty(display, root, atom, 0, 1, False, XA_WINDOW,
-                               &actual_type, &actual_format, &nitems, &bytes_after, &prop) == Success) {
-            if (actual_type == XA_WINDOW && nitems == 1 && prop) {
-                result = *((Window*)prop);
+    char line[512];
+    std::string group;
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file) {
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                group = line + 3;
             }
-            if (prop) XFree(prop);
         }
+        fclose(file);
     }
+    if (group.empty()) return cpus;   // cgroup v1 only
+    std::string cgroupRoot = cgroupMount(group);
+    if (cgroupRoot.empty()) return cpus;
+    if (group == "/") group.clear();
     
-    return result;
+    for (;;) {
+        char value[64];
+        long long quota, period;
+        // "max 100000" is no limit and doesn't parse
+        if (readSysfs(cgroupRoot + group + "/cpu.max", value, sizeof(value)) &&
+            sscanf(value, "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0) {
+            cpus = std::min(cpus, (int)std::max(1LL, (quota + period - 1) / period));
+        }
+        if (group.empty()) break;
+        group.erase(group.rfind('/'));
+    }
+    return cpus;
 }
 
-// Signal handler for graceful termination
-static void signalHandler(int sig) {
-    (void)sig;
-    g_running = false;
+// Thread-wide, unlike nice() on a process: the main loop keeps its normal priority, so
+// frames that are ready still reach the screen on time
+void platformLowerThreadPriority() {
+    if (g_niceLevel > 0) {
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), g_niceLevel) != 0) {
+            std::cerr << "Cannot set nice level " << g_niceLevel << ": " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+    struct sched_param param = {};
+    int error = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    if (error != 0) std::cerr << "Cannot switch to SCHED_IDLE: " << strerror(error) << std::endl;
 }
 
-// Xfconf helper functions for background configuration
-static void setXfconfProp(std::string suffix, int val) {
-    std::string v = std::to_string(val);
-    std::string cmd = 
-        "PREFIX=$(xfconf-query -c xfce4-desktop -l | grep last-image | head -n1 | sed 's/last-image//'); "
-        "if [ ! -z \"$PREFIX\" ]; then "
-        "  PROP=\"${PREFIX}" + suffix + "\"; "
-        "  xfconf-query -c xfce4-desktop -p \"$PROP\" -s " + v + " 2>/dev/null || "
-        "  xfconf-query -c xfce4-desktop -p \"$PROP\" -n -t int -s " + v + "; "
-        "fi";
-    system(cmd.c_str());
+// Intel hybrids list their cores under the cpu_atom and cpu_core PMUs. Elsewhere
+// cpu_capacity tells the classes apart (arm64, recent x86 hybrids), and with
+// byFrequency the cpufreq maximum stands in for it. Frequency alone is not proof:
+// favoured cores and binning spread it on CPUs with one kind of core.
+// A capacity more than 10% above the one below it starts a new class, so favoured
+// cores that turbo a little higher stay with the rest of their kind.
+int platformCoreClasses(std::vector<int>& classOf, bool byFrequency) {
+    classOf.clear();
+    char atom[256], core[256];
+    if (readSysfs(std::string(g_sysfsRoot) + "/devices/cpu_atom/cpus", atom, sizeof(atom)) &&
+        readSysfs(std::string(g_sysfsRoot) + "/devices/cpu_core/cpus", core, sizeof(core))) {
+        for (int coreClass = 0; coreClass < 2; coreClass++) {
+            for (int cpu : parseCpuList(coreClass == 0 ? atom : core)) {
+                if (cpu < 0) continue;
+                if (cpu >= (int)classOf.size()) classOf.resize(cpu + 1, -1);
+                classOf[cpu] = coreClass;
+            }
+        }
+        return 2;
+    }
+    
+    std::vector<std::pair<long, int>> capacities;   // capacity, CPU number
+    forEachEntry(std::string(g_sysfsRoot) + "/devices/system/cpu", "cpu", [&](const std::string& dir) {
+        const char* number = dir.c_str() + dir.rfind('/') + 4;
+        if (!isdigit((unsigned char)*number)) return;   // cpufreq, cpuidle
+        char value[64];
+        if (readSysfs(dir + "/cpu_capacity", value, sizeof(value)) ||
+            (byFrequency && readSysfs(dir + "/cpufreq/cpuinfo_max_freq", value, sizeof(value)))) {
+            capacities.emplace_back(atol(value), atoi(number));
+        }
+    });
+    
+    if (capacities.empty()) return 1;
+    std::sort(capacities.begin(), capacities.end());
+    int classes = 1;
+    long previous = capacities[0].first;
+    for (const auto& entry : capacities) {
+        if (entry.first > previous + previous / 10 && classes < MAX_CORE_CLASSES) classes++;
+        previous = entry.first;
+        if (entry.second >= (int)classOf.size()) classOf.resize(entry.second + 1, -1);
+        classOf[entry.second] = classes - 1;
+    }
+    return classes;
 }
 
-static void restoreXfconfSettings() {
-    static bool restored = false;
-    if (restored) return;
-    restored = true;
-    std::cout << "Restoring xfdesktop settings..." << std::endl;
-    setXfconfProp("color-style", 0); // Solid
-    setXfconfProp("image-style", 5); // Zoomed
-    std::cout << "Restored." << std::endl;
+// Called before any thread starts, so they all inherit the mask
+bool platformPinThreads(const std::vector<int>& cpus) {
+    cpu_set_t allowed, set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) CPU_SET(cpu, &set);
+    }
+    if (CPU_COUNT(&set) == 0) {
+        std::cerr << "None of the selected cores are available, not pinning" << std::endl;
+        return false;
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
 }
 
-void platformInit(int& screenWidth, int& screenHeight) {
-    // Set up signal handlers for graceful termination
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
-    
-    // Configure xfdesktop for transparency
-    std::cout << "Configuring xfdesktop for transparency..." << std::endl;
-    setXfconfProp("color-style", 3); // Transparent
-    setXfconfProp("image-style", 0); // None
-    
-    // Register exit handler to restore settings
-    atexit(restoreXfconfSettings);
-    
-    g_display = XOpenDisplay(nullptr);
-    if (!g_display) {
-        std::cerr << "Failed to open X display" << std::endl;
-        exit(1);
+int platformCurrentCpu() {
+    return sched_getcpu();
+}
+
+void platformImageReady() {
+    if (g_backend >= 2) {
+        prepareOverlay();
+    } else {
+        rebuildTileRects();
     }
     
-    g_screen = DefaultScreen(g_display);
-    g_root = DefaultRootWindow(g_display);
+    if (g_occlusion && g_rootPixmap) {
+        // Pseudo-transparent clients show the root pixmap exactly where they cover us
+        std::cout << "Occlusion tracking disabled by --root-pixmap" << std::endl;
+        g_occlusion = 0;
+    }
+    g_focusTracking = g_fullscreenPause || *g_focusClasses;
+    long rootMask = StructureNotifyMask;  // root ConfigureNotify on resolution changes
+    if (g_occlusion || g_focusTracking) {
+        g_defaultErrorHandler = XSetErrorHandler(clientErrorHandler);
+        rootMask |= PropertyChangeMask;
+    }
+    XSelectInput(g_display, g_root, rootMask);
+    if (g_occlusion) updateClientList();
+    if (g_focusTracking) updateActiveWindow();
     
+    setupIdle();
+    setupEventLoop();
+}
+
+// True once a burst of RandR or root ConfigureNotify events has settled
+bool platformLayoutChanged(int& screenWidth, int& screenHeight) {
+    if (!g_layoutDirty || platformGetTime() - g_layoutChangeTime < SETTLE_DELAY) return false;
+    g_layoutDirty = false;
     screenWidth = DisplayWidth(g_display, g_screen);
     screenHeight = DisplayHeight(g_display, g_screen);
+    return true;
+}
+
+// The new layout is installed: follow it with the window and every screen-sized resource
+void platformResize(int screenWidth, int screenHeight) {
+    std::cout << "Screen resized to " << screenWidth << "x" << screenHeight << std::endl;
     
-    std::cout << "X11 Display opened: " << screenWidth << "x" << screenHeight << std::endl;
-    
-    Visual* visual = DefaultVisual(g_display, g_screen);
-    int depth = DefaultDepth(g_display, g_screen);
-    
-    std::cout << "Using depth: " << depth << std::endl;
-    
-    Colormap colormap = XCreateColormap(g_display, g_root, visual, AllocNone);
-    
-    XSetWindowAttributes attrs;
-    attrs.colormap = colormap;
-    attrs.background_pixel = BlackPixel(g_display, g_screen);
-    attrs.event_mask = ExposureMask | StructureNotifyMask;
-    
-    g_window = XCreateWindow(
-        g_display, g_root,
-        0, 0, screenWidth, screenHeight,
-        0,                          // border width
-        depth,                      // depth
-        InputOutput,                // class
-        visual,                     // visual
-        CWColormap | CWBackPixel | CWEventMask,
-        &attrs
-    );
+    releaseFrameResources();
+    XMoveResizeWindow(g_display, g_window, 0, 0, screenWidth, screenHeight);
+    createFrameResources(screenWidth, screenHeight);
+    g_damage = {0, 0, screenWidth, screenHeight};
     
-    if (!g_window) {
-        std::cerr << "Failed to create X11 window" << std::endl;
-        exit(1);
+    if (g_backend >= 2) {
+        prepareOverlay();
+    } else {
+        rebuildTileRects();
     }
-    
-    // Set _NET_WM_WINDOW_TYPE to DESKTOP
-    Atom atom_type = XInternAtom(g_display, "_NET_WM_WINDOW_TYPE", False);
-    Atom atom_desktop = XInternAtom(g_display, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
-    XChangeProperty(g_display, g_window, atom_type, XA_ATOM, 32, PropModeReplace,
-                    (unsigned char*)&atom_desktop, 1);
-    
+    if (g_occlusion) g_occlusionDirty = true;
+    XFlush(g_display);
+}
 
+// Upload tile rows [row0, row1) into the back buffer and push them out to the server
+void platformRenderBand(int row0, int row1) {
+    if (g_backend == 1) {
+        renderBitmap(row0, row1);
+    } else if (g_backend >= 2) {
+        renderOverlay(row0, row1);
+    } else {
+        renderZPixmap(row0, row1);
+    }
+    if (row1 < g_tilesY) XFlush(g_display);
+}
+
+void platformPresent() {
+    // Every band has now been sent once, so later frames may diff against g_presented
+    if (g_backend >= 2) g_presentedValid = true;
+    if (g_frameUsedRects) g_rectFrames++;
+    g_frameUsedRects = false;
+    presentFrame();
+    if (g_rootPixmap) refreshRootPixmap();
+}
+
+void platformSkipFrame() {
+    waitForVblankSlot();
+}
+
+void platformTilesChanged() {
+    rebuildTileRects();
+}
+
+bool platformFrameReady() {
+    // While the server is behind, skip dithering rather than queue more frames
+    return !g_presentPending && g_framesInFlight < g_maxInFlight;
+}
+
+// 0 pauses rendering, >0 caps the frame rate, -1 leaves max_fps alone
+int platformFpsCap() {
+    if (!g_windowMapped || g_windowObscured) return 0;
+    if (g_saverActive || g_displayOff) return 0;
+    if (g_activeFullscreen && g_fullscreenPause) return 0;
     
-    XStoreName(g_display, g_window, "Live Dither Background");
-    
-    // Use XShape extension to make window input-transparent (click-through)
-#ifdef ShapeInput
-    XRectangle rect = {0, 0, 1, 1};
-    Region rgn = XCreateRegion();
-    XUnionRectWithRegion(&rect, rgn, rgn);
-    XShapeCombineRegion(g_display, g_window, ShapeInput, 0, 0, rgn, ShapeSet);
-    XDestroyRegion(rgn);
-    std::cout << "XShape input transparency enabled" << std::endl;
-#endif
-    
-    XMapWindow(g_display, g_window);
-    
-    Window xfdesktopWin = getXfceDesktopWindow(g_display, g_root);
+    int cap = -1;
+    if (g_userIdle) cap = g_idleFps;
+    if (g_activeMatched && (cap < 0 || g_focusFps < cap)) cap = g_focusFps;
+    return cap;
+}
+
+// Block until the X server has something for us, a signal arrives or the timeout
+// (ms, -1 = none) runs out. Input while idle wakes us through the IDLETIME alarm.
+void platformWaitEvents(int timeoutMs) {
+    XFlush(g_display);
+    if (XPending(g_display)) return;
     
-    // Force proper desktop behavior via _NET_WM_STATE
-    Atom atom_state = XInternAtom(g_display, "_NET_WM_STATE", False);
-    Atom atoms[4];
-    atoms[0] = XInternAtom(g_display, "_NET_WM_STATE_BELOW", False);
-    atoms[1] = XInternAtom(g_display, "_NET_WM_STATE_SKIP_TASKBAR", False);
-    atoms[2] = XInternAtom(g_display, "_NET_WM_STATE_SKIP_PAGER", False);
-    atoms[3] = XInternAtom(g_display, "_NET_WM_STATE_STICKY", False);
+    // DPMS has no events, so keep waking up to poll it while idle
+    int dpmsMs = (int)(DPMS_POLL_INTERVAL * 1000.0);
+    if (g_userIdle && g_dpmsAvailable && (timeoutMs < 0 || timeoutMs > dpmsMs)) timeoutMs = dpmsMs;
     
-    XChangeProperty(g_display, g_window, atom_state, XA_ATOM, 32, PropModeReplace,
-                    (unsigned char*)atoms, 4);
-
-    // Configure window stacking order
-    if (xfdesktopWin != None) {
-        std::cout << "Found xfdesktop window: " << xfdesktopWin << std::endl;
-        
-        XLowerWindow(g_display, xfdesktopWin);
-        XLowerWindow(g_display, g_window);
-        
-        // Activate show desktop mode to ensure proper layering
-        std::cout << "Activating show desktop mode..." << std::endl;
-        int ret = system("wmctrl -k on");
-        if (ret != 0) std::cerr << "Warning: wmctrl call failed" << std::endl;
-        
-    } else {
-        std::cout << "Warning: xfdesktop window not found. Icons may be hidden." << std::endl;
-        XLowerWindow(g_display, g_window);
+    // Deferred work has no event of its own either: throttled occlusion updates and
+    // layout or image changes waiting to settle
+    double due = -1.0;
+    auto defer = [&due](bool pending, double time) {
+        if (pending && (due < 0.0 || time < due)) due = time;
+    };
+    defer(g_occlusionDirty, g_lastOcclusionUpdate + OCCLUSION_INTERVAL);
+    defer(g_layoutDirty, g_layoutChangeTime + SETTLE_DELAY);
+    defer(g_imagesDirty, g_imageChangeTime + SETTLE_DELAY);
+    if (due >= 0.0) {
+        int dueMs = std::max(0, (int)ceil((due - platformGetTime()) * 1000.0));
+        if (timeoutMs < 0 || timeoutMs > dueMs) timeoutMs = dueMs;
     }
     
-    g_gc = XCreateGC(g_display, g_window, 0, nullptr);
-    
-    g_imageData = new char[screenWidth * screenHeight * 4];
-    memset(g_imageData, 0, screenWidth * screenHeight * 4);
+    waitForWakeup(timeoutMs);
+}
+
+// Image files settle like layout changes: a copy may close the file more than once
+bool platformImagesChanged() {
+    if (!g_imagesDirty || platformGetTime() - g_imageChangeTime < SETTLE_DELAY) return false;
+    g_imagesDirty = false;
+    return true;
+}
+
+// One monitor per active CRTC; cloned outputs share a CRTC and count once
+void platformQueryMonitors(std::vector<Monitor>& monitors) {
+    XRRScreenResources* res = XRRGetScreenResourcesCurrent(g_display, g_root);
+    if (!res) return;
     
-    g_ximage = XCreateImage(g_display, visual, depth, ZPixmap, 0,
-                            g_imageData, screenWidth, screenHeight, 32, 0);
+    std::vector<RRCrtc> seen;
+    for (int i = 0; i < res->noutput; i++) {
+        XRROutputInfo* output = XRRGetOutputInfo(g_display, res, res->outputs[i]);
+        if (!output) continue;
+        if (output->connection == RR_Connected && output->crtc &&
+            std::find(seen.begin(), seen.end(), output->crtc) == seen.end()) {
+            XRRCrtcInfo* crtc = XRRGetCrtcInfo(g_display, res, output->crtc);
+            // Disabled outputs keep a CRTC without a mode
+            if (crtc && crtc->mode != None && crtc->width > 0 && crtc->height > 0) {
+                Monitor m;
+                m.name = output->name;
+                m.x = crtc->x;
+                m.y = crtc->y;
+                m.width = (int)crtc->width;
+                m.height = (int)crtc->height;
+                monitors.push_back(m);
+                seen.push_back(output->crtc);
+            }
+            if (crtc) XRRFreeCrtcInfo(crtc);
+        }
+        XRRFreeOutputInfo(output);
+    }
+    XRRFreeScreenResources(res);
+}
+
+// Refresh rate of the primary output's CRTC, or of the first active one
+static double queryRefreshRate() {
+    XRRScreenResources* res = XRRGetScreenResourcesCurrent(g_display, g_root);
+    if (!res) return 0.0;
     
-    if (!g_ximage) {
-        std::cerr << "Failed to create XImage" << std::endl;
-        exit(1);
+    RRCrtc crtc = None;
+    RROutput primary = XRRGetOutputPrimary(g_display, g_root);
+    if (primary) {
+        XRROutputInfo* output = XRRGetOutputInfo(g_display, res, primary);
+        if (output) {
+            crtc = output->crtc;
+            XRRFreeOutputInfo(output);
+        }
     }
     
-    XFlush(g_display);
+    double rate = 0.0;
+    for (int i = -1; i < res->ncrtc && rate == 0.0; i++) {
+        RRCrtc candidate = (i < 0) ? crtc : res->crtcs[i];
+        if (!candidate) continue;
+        XRRCrtcInfo* info = XRRGetCrtcInfo(g_display, res, candidate);
+        if (!info) continue;
+        for (int m = 0; m < res->nmode; m++) {
+            const XRRModeInfo& mode = res->modes[m];
+            if (mode.id != info->mode || mode.hTotal == 0 || mode.vTotal == 0) continue;
+            rate = (double)mode.dotClock / ((double)mode.hTotal * mode.vTotal);
+            if (mode.modeFlags & RR_DoubleScan) rate /= 2.0;
+            if (mode.modeFlags & RR_Interlace) rate *= 2.0;
+        }
+        XRRFreeCrtcInfo(info);
+    }
     
-    std::cout << "X11 desktop window initialized with XShape click-through" << std::endl;
+    XRRFreeScreenResources(res);
+    return rate;
 }
 
-void platformRender() {
-    for (int y = 0; y < g_imgHeight; y++) {
-        for (int x = 0; x < g_imgWidth; x++) {
-            int srcX = x / g_pixelSize;
-            int srcY = y / g_pixelSize;
-            if (srcX >= g_scaledWidth) srcX = g_scaledWidth - 1;
-            if (srcY >= g_scaledHeight) srcY = g_scaledHeight - 1;
-            
-            int srcIdx = (srcY * g_scaledWidth + srcX) * 4;
-            int dstIdx = (y * g_imgWidth + x) * 4;
-            
-            // RGBA to BGRX conversion
-            g_imageData[dstIdx + 0] = g_scaledPixels[srcIdx + 2];  // B
-            g_imageData[dstIdx + 1] = g_scaledPixels[srcIdx + 1];  // G
-            g_imageData[dstIdx + 2] = g_scaledPixels[srcIdx + 0];  // R
-            g_imageData[dstIdx + 3] = 0;                           // X (padding)
-        }
+// Runs again after every layout change, since a new monitor may bring another refresh rate.
+// g_maxFps keeps the requested rate, so the timer still has it when the rate is unknown.
+bool platformSetupPacing() {
+    g_refreshRate = queryRefreshRate();
+    g_maxFpsDivisor = 0;
+    g_vblankDivisor = 0;
+    if (g_refreshRate > 0.0 && g_maxFps > 0) {
+        // Snap the FPS cap to a whole divisor of the refresh rate so every frame
+        // gets the same number of vblanks; 60 on 144 Hz becomes 48, not 59/61
+        int divisor = (int)ceil(g_refreshRate / g_maxFps - 0.05);
+        if (divisor < 1) divisor = 1;
+        g_vblankDivisor = divisor;
+        g_maxFpsDivisor = divisor;
+        int snapped = (int)lround(g_refreshRate / divisor);
+        std::cout << "Refresh rate: " << g_refreshRate << " Hz, max FPS " << g_maxFps
+                  << " -> " << snapped << " (1 frame per " << divisor << " vblanks)" << std::endl;
     }
     
-    XPutImage(g_display, g_window, g_gc, g_ximage, 0, 0, 0, 0, g_imgWidth, g_imgHeight);
-    XFlush(g_display);
+#if HAVE_XPRESENT
+    // PresentCompleteNotify paces the loop; the timer only covers the fallback
+    if (g_presentAvailable && g_target == g_backBuffer) {
+        std::cout << "Frame pacing: Present (vblank)" << std::endl;
+        return true;
+    }
+#endif
+    std::cout << "Frame pacing: timer" << std::endl;
+    return false;
+}
+
+// Under vblank pacing a lower FPS cap becomes a larger divisor, snapped to the nearest
+// refresh/N like max_fps; 0 goes back to max_fps. False leaves the rate to the timer:
+// without a refresh rate (Xvfb modes have no timings) vblanks alone would run uncapped.
+bool platformPaceFps(int fps) {
+    if (g_refreshRate <= 0.0) return false;
+    int divisor = g_maxFpsDivisor;
+    if (fps > 0) divisor = std::max(divisor, std::max(1, (int)lround(g_refreshRate / fps)));
+    g_vblankDivisor = divisor;
+    return true;
 }
 
 void platformPollEvents() {
     while (XPending(g_display)) {
         XEvent event;
         XNextEvent(g_display, &event);
-        if (event.type == DestroyNotify) {
+        if (event.type == DestroyNotify && event.xdestroywindow.window == g_window) {
             g_running = false;
+        } else if (event.type == VisibilityNotify && event.xvisibility.window == g_window) {
+            g_windowObscured = event.xvisibility.state == VisibilityFullyObscured;
+        } else if ((event.type == MapNotify || event.type == UnmapNotify) && event.xany.window == g_window) {
+            g_windowMapped = event.type == MapNotify;
+        } else if (event.type == PropertyNotify && event.xproperty.atom == g_atoms[ATOM_LIVE_DITHER_FRAME]) {
+            if (g_framesInFlight > 0) g_framesInFlight--;
+        } else if (event.type == PropertyNotify && event.xproperty.window == g_root) {
+            if (event.xproperty.atom == g_atoms[ATOM_NET_CLIENT_LIST_STACKING] && g_occlusion) updateClientList();
+            if (event.xproperty.atom == g_atoms[ATOM_NET_ACTIVE_WINDOW] && g_focusTracking) updateActiveWindow();
+        } else if (event.type == PropertyNotify && event.xproperty.window == g_activeWindow) {
+            if (event.xproperty.atom == g_atoms[ATOM_NET_WM_STATE] || event.xproperty.atom == XA_WM_CLASS) {
+                updateActiveState();
+            }
+        } else if (event.type == ConfigureNotify && event.xconfigure.window == g_root) {
+            XRRUpdateConfiguration(&event);
+            g_layoutDirty = true;
+            g_layoutChangeTime = platformGetTime();
+        } else if (g_randrEventBase >= 0 && (event.type == g_randrEventBase + RRScreenChangeNotify ||
+                                             event.type == g_randrEventBase + RRNotify)) {
+            // Keeps DisplayWidth/Height current; CRTC changes can move monitors at a fixed size
+            XRRUpdateConfiguration(&event);
+            g_layoutDirty = true;
+            g_layoutChangeTime = platformGetTime();
+        } else if (event.type == ConfigureNotify || event.type == MapNotify || event.type == UnmapNotify ||
+                   event.type == DestroyNotify) {
+            // Only other clients' structure events reach us besides our own window's
+            if (event.xany.window != g_window) updateClientGeometry(event);
+        } else if (g_idleAlarm && event.type == g_syncEventBase + XSyncAlarmNotify) {
+            XSyncAlarmNotifyEvent* alarm = (XSyncAlarmNotifyEvent*)&event;
+            if (alarm->alarm == g_idleAlarm) {
+                g_userIdle = true;
+                g_lastIdlePoll = platformGetTime();
+            } else if (alarm->alarm == g_activeAlarm) {
+                // Input is back: full rate from the next frame on
+                g_userIdle = false;
+                g_displayOff = false;
+            }
+        }
+#if HAVE_XSS
+        else if (g_saverEventBase >= 0 && event.type == g_saverEventBase + ScreenSaverNotify) {
+            g_saverActive = ((XScreenSaverNotifyEvent*)&event)->state == ScreenSaverOn;
+        }
+#endif
+        else if (event.type == Expose) {
+            if (g_target == g_backBuffer) {
+                // The back buffer still holds the frame; copy it back server-side
+                XCopyArea(g_display, g_backBuffer, g_window, g_gc,
+                          event.xexpose.x, event.xexpose.y, event.xexpose.width, event.xexpose.height,
+                          event.xexpose.x, event.xexpose.y);
+            } else {
+                // The server repainted the static background there; resend the overlay
+                g_presentedValid = false;
+                g_redrawNeeded = true;
+            }
+        }
+#if HAVE_XPRESENT
+        else if (event.type == GenericEvent && event.xcookie.extension == g_presentOpcode) {
+            if (XGetEventData(g_display, &event.xcookie)) {
+                if (event.xcookie.evtype == PresentCompleteNotify) {
+                    // Completed presents and MSC notifies for skipped frames alike
+                    XPresentCompleteNotifyEvent* complete = (XPresentCompleteNotifyEvent*)event.xcookie.data;
+                    // Count presents that slipped past their vblank slot
+                    if (g_lastMsc != 0 && g_vblankDivisor > 0 && complete->msc > g_lastMsc + g_vblankDivisor) {
+                        g_lateFrames++;
+                    }
+                    g_lastMsc = complete->msc;
+                    g_presentPending = false;
+                }
+                XFreeEventData(g_display, &event.xcookie);
+            }
         }
+#endif
     }
+    
+    // Coalesce bursts (window drags) to at most 20 visibility updates per second
+    if (g_occlusionDirty && platformGetTime() - g_lastOcclusionUpdate >= OCCLUSION_INTERVAL) updateOcclusion();
+    pollDisplayPower();
 }
 
-void platformCleanup() {
-    if (g_ximage) {
-        g_ximage->data = nullptr;  // Prevent XDestroyImage from freeing our buffer
-        XDestroyImage(g_ximage);
+std::string platformProfileStats() {
+    std::string stats;
+    if (g_backend >= 2) stats += " | rect frames: " + std::to_string(g_rectFrames);
+    g_rectFrames = 0;
+    if (g_occlusion) {
+        char visible[32];
+        snprintf(visible, sizeof(visible), "%.1f%%", 100.0 * g_visibleArea / ((long long)g_imgWidth * g_imgHeight));
+        stats += std::string(" | visible: ") + visible;
     }
-    delete[] g_imageData;
+    stats += " | in flight: " + std::to_string(g_framesInFlight) + " (peak " + std::to_string(g_peakInFlight) +
+             ", throttled " + std::to_string(g_throttledFrames) + ")";
+    g_peakInFlight = g_framesInFlight;
+    g_throttledFrames = 0;
+#if HAVE_XPRESENT
+    if (g_presentAvailable) stats += " | late presents: " + std::to_string(g_lateFrames);
+    g_lateFrames = 0;
+#endif
+    if (g_userIdle) stats += " | idle";
+    return stats;
+}
+
+void platformCleanup() {
+    releaseFrameResources();
+    freeFrameBuffer(g_imageData, false);
+    freeFrameBuffer(g_bitmapData, true);
+    releaseRootPixmap();
+    if (g_idleAlarm) XSyncDestroyAlarm(g_display, g_idleAlarm);
+    if (g_activeAlarm) XSyncDestroyAlarm(g_display, g_activeAlarm);
+#if HAVE_XPRESENT
+    if (g_presentRegion) XFixesDestroyRegion(g_display, g_presentRegion);
+    if (g_presentEventId) XPresentFreeInput(g_display, g_window, g_presentEventId);
+#endif
     if (g_gc) { XFreeGC(g_display, g_gc); g_gc = nullptr; }
     if (g_window) XDestroyWindow(g_display, g_window);
     if (g_display) XCloseDisplay(g_display);
+    if (g_inotifyFd >= 0) close(g_inotifyFd);
+    if (g_timerFd >= 0) close(g_timerFd);
+    if (g_epollFd >= 0) close(g_epollFd);
 }
 
+// Monotonic, so NTP or manual clock changes can't stall or rush the pacing
 double platformGetTime() {
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    return tv.tv_sec + tv.tv_usec / 1000000.0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+double platformThreadCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
 }
 
-void platformSleep(int ms) {
-    usleep(ms * 1000);
+// Sleep to an absolute deadline, so wakeups don't drift by however long the frame took.
+// An X event ends the sleep early so it is handled right away. The last --spin-us are
+// busy-waited to get below the kernel's timer slack.
+void platformSleepUntil(double deadline) {
+    double wake = deadline - g_spinUs / 1000000.0;
+    if (wake > platformGetTime()) {
+        struct timespec ts = toTimespec(wake);
+        if (g_timerFd >= 0) {
+            struct itimerspec timer = {};
+            timer.it_value = ts;
+            timerfd_settime(g_timerFd, TFD_TIMER_ABSTIME, &timer, nullptr);
+            platformWaitEvents(-1);
+            if (platformGetTime() < wake) return;
+        } else {
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+        }
+    }
+    if (g_spinUs > 0) {
+        while (platformGetTime() < deadline) {}
+    }
 }
 
 #endif // PLATFORM_X11
 
+/*
+ * Option Parsing
+ */
+static void parseOption(const char* opt) {
+    const char* eq = strchr(opt, '=');
+    std::string key = eq ? std::string(opt, eq - opt) : std::string(opt);
+    const char* value = eq ? eq + 1 : "";
+    
+    if (key == "backend") {
+        if (strcmp(value, "zpixmap") == 0) g_backend = 0;
+        else if (strcmp(value, "bitmap") == 0) g_backend = 1;
+        else if (strcmp(value, "overlay") == 0) g_backend = 2;
+        else if (strcmp(value, "rects") == 0) g_backend = 3;
+        else std::cerr << "Unknown backend: " << value << std::endl;
+    } else if (key == "double-buffer") {
+        g_doubleBuffer = atoi(value) != 0;
+    } else if (key == "occlusion") {
+        g_occlusion = atoi(value) != 0;
+    } else if (key == "xcb") {
+        g_useXcb = atoi(value) != 0;
+    } else if (key == "root-pixmap") {
+        g_rootPixmapRate = (float)atof(value);
+        if (g_rootPixmapRate < 0.0f) g_rootPixmapRate = 0.0f;
+    } else if (key == "idle-timeout") {
+        g_idleTimeout = atoi(value);
+        if (g_idleTimeout < 0) g_idleTimeout = 0;
+    } else if (key == "monitor") {
+        // NAME:image=PATH,pixel=N,fps=N
+        MonitorConfig config;
+        const char* colon = strchr(value, ':');
+        config.name = colon ? std::string(value, colon - value) : std::string(value);
+        for (const char* item = colon ? colon + 1 : ""; *item; ) {
+            const char* comma = strchr(item, ',');
+            std::string pair = comma ? std::string(item, comma - item) : std::string(item);
+            size_t split = pair.find('=');
+            std::string name = pair.substr(0, split);
+            std::string setting = split == std::string::npos ? "" : pair.substr(split + 1);
+            if (name == "image") config.image = setting;
+            else if (name == "pixel") config.pixelSize = atoi(setting.c_str());
+            else if (name == "fps") config.fps = atoi(setting.c_str());
+            else std::cerr << "Unknown monitor setting: " << name << std::endl;
+            if (!comma) break;
+            item = comma + 1;
+        }
+        g_monitorConfigs.push_back(config);
+    } else if (key == "fullscreen-pause") {
+        g_fullscreenPause = atoi(value) != 0;
+    } else if (key == "focus-classes") {
+        g_focusClasses = value;
+    } else if (key == "focus-fps") {
+        g_focusFps = atoi(value);
+        if (g_focusFps < 0) g_focusFps = 0;
+    } else if (key == "idle-fps") {
+        g_idleFps = atoi(value);
+        if (g_idleFps < 0) g_idleFps = 0;
+    } else if (key == "power-profile") {
+        // STATE:fps=N,pixel=N,algorithm=N,flip=N,slack=US
+        const char* colon = strchr(value, ':');
+        std::string state = colon ? std::string(value, colon - value) : std::string(value);
+        int index = 0;
+        while (index < POWER_STATES && state != POWER_STATE_NAMES[index]) index++;
+        if (index == POWER_STATES) {
+            std::cerr << "Unknown power state: " << state << std::endl;
+            return;
+        }
+        PowerProfile& profile = g_powerProfiles[index];
+        for (const char* item = colon ? colon + 1 : ""; *item; ) {
+            const char* comma = strchr(item, ',');
+            std::string pair = comma ? std::string(item, comma - item) : std::string(item);
+            size_t split = pair.find('=');
+            std::string name = pair.substr(0, split);
+            int setting = split == std::string::npos ? 0 : atoi(pair.c_str() + split + 1);
+            if (name == "fps") profile.fps = setting;
+            else if (name == "pixel") profile.pixelSize = setting;
+            else if (name == "algorithm") profile.algorithm = setting;
+            else if (name == "flip") profile.flip = setting;
+            else if (name == "slack") profile.slackUs = setting;
+            else std::cerr << "Unknown power profile setting: " << name << std::endl;
+            if (!comma) break;
+            item = comma + 1;
+        }
+    } else if (key == "power-policy") {
+        g_powerPolicy = atoi(value) != 0;
+    } else if (key == "sysfs-root") {
+        g_sysfsRoot = value;
+    } else if (key == "low-battery") {
+        g_lowBattery = atoi(value);
+    } else if (key == "hot-temp") {
+        g_hotTemp = atoi(value);
+    } else if (key == "background") {
+        g_background = atoi(value) != 0;
+    } else if (key == "nice") {
+        g_niceLevel = std::min(std::max(atoi(value), 0), 19);
+    } else if (key == "cores") {
+        g_cores = value;
+    } else if (key == "cpu-budget") {
+        g_cpuBudget = (float)atof(value);
+        if (g_cpuBudget < 0.0f) g_cpuBudget = 0.0f;
+    } else if (key == "spin-us") {
+        g_spinUs = atoi(value);
+        if (g_spinUs < 0) g_spinUs = 0;
+    } else if (key == "lookahead") {
+        g_lookahead = std::min(std::max(atoi(value), 0), 64);
+    } else if (key == "bands") {
+        g_bands = atoi(value);
+        if (g_bands < 1) g_bands = 1;
+    } else if (key == "max-inflight") {
+        g_maxInFlight = atoi(value);
+        if (g_maxInFlight < 1) g_maxInFlight = 1;
+    } else {
+        std::cerr << "Unknown option: --" << key << std::endl;
+    }
+}
+
 /*
  * Main Entry Point
  */
+// Median and 99th percentile of the frame intervals, for the profile line
+static std::string intervalStats(std::vector<double>& intervals) {
+    if (intervals.empty()) return "";
+    auto percentile = [&](double p) {
+        size_t index = std::min((size_t)(p * intervals.size()), intervals.size() - 1);
+        std::nth_element(intervals.begin(), intervals.begin() + index, intervals.end());
+        return intervals[index] * 1000.0;
+    };
+    char stats[64];
+    snprintf(stats, sizeof(stats), " | interval p50 %.2f ms, p99 %.2f ms", percentile(0.5), percentile(0.99));
+    return stats;
+}
+
 int main(int argc, char* argv[]) {
     srand((unsigned int)time(nullptr));
     
@@ -754,14 +4192,25 @@ int main(int argc, char* argv[]) {
         return 0;
     }
     
+    // Split --key=value options from positional args
+    std::vector<char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            parseOption(argv[i] + 2);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    int nargs = (int)args.size();
+    
     // Parse CLI args: image algorithm threshold pixel_size max_fps profile chaos
-    if (argc > 1) g_imagePath = argv[1];
-    if (argc > 2) g_algorithm = atoi(argv[2]);
-    if (argc > 3) g_threshold = atoi(argv[3]);
-    if (argc > 4) g_pixelSize = atoi(argv[4]);
-    if (argc > 5) g_maxFps = atoi(argv[5]);
-    if (argc > 6) g_profile = atoi(argv[6]);
-    if (argc > 7) g_chaos = atoi(argv[7]);
+    if (nargs > 0) g_imagePath = args[0];
+    if (nargs > 1) g_algorithm = atoi(args[1]);
+    if (nargs > 2) g_threshold = atoi(args[2]);
+    if (nargs > 3) g_pixelSize = atoi(args[3]);
+    if (nargs > 4) g_maxFps = atoi(args[4]);
+    if (nargs > 5) g_profile = atoi(args[5]);
+    if (nargs > 6) g_chaos = atoi(args[6]);
     
     // Validate
     if (g_algorithm < 0 || g_algorithm > 2) g_algorithm = 1;
@@ -771,6 +4220,7 @@ int main(int argc, char* argv[]) {
     if (g_maxFps < 0) g_maxFps = 0;
     if (g_chaos < 0) g_chaos = 0;
     if (g_chaos > 100) g_chaos = 100;
+    resolvePowerProfiles();
     
     const char* algoNames[] = {"static", "random", "wave"};
     std::cout << "Live Dither Background" << std::endl;
@@ -785,52 +4235,173 @@ int main(int argc, char* argv[]) {
     std::cout << "Pixel Size: " << g_pixelSize << std::endl;
     std::cout << "Max FPS: " << (g_maxFps == 0 ? "unlimited" : std::to_string(g_maxFps)) << std::endl;
     std::cout << "Chaos: " << g_chaos << "%" << std::endl;
+#if PLATFORM_X11
+    const char* backendNames[] = {"zpixmap", "bitmap", "overlay", "rects"};
+    std::cout << "Backend: " << backendNames[g_backend] << std::endl;
+#endif
     std::cout << std::endl;
     
+    // Hybrid CPUs: keep every thread on the efficiency cores, unless --cores says otherwise.
+    // Threads inherit the mask, so this comes before any of them start.
+    g_coreClasses = platformCoreClasses(g_coreClass, strcmp(g_cores, "efficient") == 0);
+    std::vector<int> cores = selectedCores();
+    if (!cores.empty() && platformPinThreads(cores)) {
+        std::cout << "Pinned to CPUs:";
+        for (int cpu : cores) std::cout << " " << cpu;
+        std::cout << std::endl;
+    }
+    g_cpuAccounting = g_cpuBudget > 0.0f || (g_profile && g_coreClasses > 1);
+    
     int screenWidth, screenHeight;
     platformInit(screenWidth, screenHeight);
     
-    loadAndPrepareImage(g_imagePath, screenWidth, screenHeight);
+    std::vector<Monitor> monitors;
+    platformQueryMonitors(monitors);
+    configureMonitors(monitors, screenWidth, screenHeight, g_pixelSize);
     
-    if (g_pixelStates.empty()) {
+    PreparedImage image;
+    image.pixelSize = g_pixelSize;
+    image.monitors.swap(monitors);
+    if (!prepareImage(image, screenWidth, screenHeight)) {
         std::cerr << "Failed to load " << g_imagePath << std::endl;
+        freeSources();
         platformCleanup();
         return 1;
     }
+    installImage(image);
+    g_cpuLimit = platformCpuLimit();
+    platformSetTimerSlack(currentPowerProfile().slackUs);  // before the threads, so they inherit it
+    startWorkers();
+    startProducer();
+    std::cout << "Dither threads: " << g_ditherThreads << " (CPU limit " << g_cpuLimit << ")";
+    if (g_background && g_niceLevel > 0) std::cout << ", nice " << g_niceLevel;
+    else if (g_background) std::cout << ", idle priority";
+    std::cout << std::endl;
+    
+    platformImageReady();
     
     // Main loop
     double lastFrameTime = platformGetTime();
-    double targetFrameTime = g_maxFps > 0 ? 1.0 / g_maxFps : 0.0;
+    double nextDeadline = lastFrameTime;
+    bool vsyncPaced = platformSetupPacing();
     int frameCount = 0;
     double fpsTimer = 0.0;
+    std::vector<double> frameIntervals;
+    int layoutPixelSize = g_pixelSize;
     
     while (g_running) {
         platformPollEvents();
+        updatePowerPolicy();
+        applyOperatingPoint();
+        
+        int fpsCap = platformFpsCap();
+        int powerFps = operatingFps();
+        bool powerPaused = powerFps == 0 && fpsCap != 0;
+        if (powerFps >= 0 && (fpsCap < 0 || powerFps < fpsCap)) fpsCap = powerFps;
+        if (fpsCap == 0) {
+            // Nothing can be seen: no dithering, just sleep until the next event, or the
+            // next power check when that is what paused us
+            platformWaitEvents(powerPaused ? (int)(POWER_POLL_INTERVAL * 1000.0) : -1);
+            continue;
+        }
+        
+        // Under vblank pacing max_fps and any lower platform or power cap are vblank
+        // divisors; the timer keeps them when the refresh rate is unknown
+        bool capped = fpsCap > 0 && (g_maxFps == 0 || fpsCap < g_maxFps);
+        bool vblankPaced = vsyncPaced && platformPaceFps(capped ? fpsCap : 0);
+        double targetFrameTime = vblankPaced ? 0.0
+                               : capped ? 1.0 / fpsCap : g_maxFps > 0 ? 1.0 / g_maxFps : 0.0;
+        
+        if (!platformFrameReady()) {
+            // Previous frame hasn't reached the screen yet; its completion arrives as an event
+            platformWaitEvents(-1);
+            continue;
+        }
+        
+        // Screen geometry, an image or the operating point's pixel size changed: prepare the
+        // new layout in the background, keep animating the old one, and swap between
+        // frames once it is ready
+        if (!g_prepareRunning) {
+            bool layoutChanged = platformLayoutChanged(screenWidth, screenHeight);
+            bool imagesChanged = platformImagesChanged();
+            bool pixelChanged = operatingPixelSize() != layoutPixelSize;
+            if (layoutChanged) vsyncPaced = platformSetupPacing();
+            if (layoutChanged || imagesChanged || pixelChanged) {
+                layoutPixelSize = operatingPixelSize();
+                monitors.clear();
+                platformQueryMonitors(monitors);
+                configureMonitors(monitors, screenWidth, screenHeight, layoutPixelSize);
+                if (imagesChanged) freeSources();  // decode the new files
+                if (imagesChanged || pixelChanged || !sameMonitorLayout(monitors, screenWidth, screenHeight)) {
+                    beginRelayout(monitors, screenWidth, screenHeight, layoutPixelSize);
+                }
+            }
+        }
+        if (finishRelayout()) {
+            platformResize(g_imgWidth, g_imgHeight);
+            g_redrawNeeded = true;
+        }
+        
+        // A static frame never changes: after the first one, only damage brings a redraw.
+        // A power profile may have made it static, so the next power check still comes.
+        if (g_algorithm == 0 && !g_redrawNeeded) {
+            platformWaitEvents(g_prepareRunning ? 50 : g_powerPolicy ? (int)(POWER_POLL_INTERVAL * 1000.0) : -1);
+            continue;
+        }
         
         double now = platformGetTime();
         double elapsed = now - lastFrameTime;
         
-        if (g_maxFps == 0 || elapsed >= targetFrameTime) {
-            ditherFrame();
-            platformRender();
+        if (targetFrameTime == 0.0 || now >= nextDeadline) {
+            double presentStart = g_cpuAccounting ? platformThreadCpuTime() : 0.0;
+            presentNextFrame();
+            recordPresentCost(presentStart);
+            updateGovernor(now);
             lastFrameTime = now;
             frameCount++;
             
+            // Deadlines advance by whole periods, so late wakeups don't add up. After a
+            // pause or a stall, pacing restarts from now instead of rushing to catch up.
+            nextDeadline += targetFrameTime;
+            if (nextDeadline <= now) nextDeadline = now + targetFrameTime;
+            
             // FPS counter
             if (g_profile) {
+                frameIntervals.push_back(elapsed);
                 fpsTimer += elapsed;
                 if (fpsTimer >= 1.0) {
-                    std::cout << "FPS: " << frameCount << std::endl;
+                    std::cout << "FPS: " << frameCount << intervalStats(frameIntervals)
+                              << " | dither waits: " << g_producerWaits;
+                    if (g_unchangedFrames) std::cout << " | unchanged: " << g_unchangedFrames;
+                    if (g_lookahead > 0 && g_algorithm != 0) {
+                        std::cout << " | lookahead low: " << g_aheadLow.exchange(g_lookahead);
+                    }
+                    if (g_cpuBudget > 0.0f) {
+                        char cpu[32];
+                        snprintf(cpu, sizeof(cpu), " | cpu %.1f%% ", g_cpuShare);
+                        std::cout << cpu << "(" << operatingPointStats() << ")";
+                    }
+                    if (g_coreClasses > 1) std::cout << coreCostStats();
+                    std::cout << platformProfileStats() << std::endl;
                     frameCount = 0;
+                    g_producerWaits = 0;
+                    g_unchangedFrames = 0;
                     fpsTimer = 0.0;
+                    frameIntervals.clear();
                 }
             }
+        } else if (capped) {
+            // Long throttled sleeps still wake up for the event that lifts the cap
+            platformWaitEvents((int)ceil((nextDeadline - now) * 1000.0));
         } else {
-            int sleepMs = (int)((targetFrameTime - elapsed) * 1000.0);
-            if (sleepMs > 0) platformSleep(sleepMs);
+            platformSleepUntil(nextDeadline);
         }
     }
     
+    if (g_prepareThread.joinable()) g_prepareThread.join();
+    stopProducer();
+    stopWorkers();
+    freeSources();
 #if PLATFORM_X11
     restoreXfconfSettings();
 #endif